@@ -0,0 +1,563 @@
+/* *****************************************************************
+ * Benchmarks do reader.cpp. Reaproveita todas as funções do programa
+ * principal incluindo o próprio reader.cpp sem o seu main.
+ * -----------------------------------------------------------------
+ * g++ -O2 -pthread benchmark.cpp -o benchmark
+ * ./benchmark parse images/fig01.pgm 10
+ * ./benchmark window images/Tropics_Sea_Palms_Swing_Beach_528262_640x480.pgm 10
+ * ./benchmark threads 4096 5
+ * ./benchmark build 4096 5
+ * ./benchmark top images/fig01.pgm
+ * ./benchmark scaling 16384 3 5 > scaling.csv
+ * -----------------------------------------------------------------
+ * *****************************************************************/
+#define READER_NO_MAIN
+#include "reader.cpp"
+
+double wallTime(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+long fileSize(char* filename){
+    struct stat fileStat;
+    if(stat(filename, &fileStat) < 0){
+        printf("Error: Unable to open file %s.\n\n", filename);
+        exit(1);
+    }
+    return fileStat.st_size;
+}
+
+/*
+ * Compara a taxa de leitura (MB/s) de um P2 entre o fscanf por pixel e o
+ * tokenizador paralelo, conferindo que as duas leituras são idênticas.
+ */
+void benchmarkParse(char* filename, int repetitions){
+    double megabytes = fileSize(filename) / (1024.0 * 1024.0);
+
+    double start = wallTime();
+    Image<long long>* reference = NULL;
+    for(int r = 0; r < repetitions; r++){
+        if(r > 0) freeImage(reference);
+        reference = readAsciiImageUsingFscanf(filename);
+    }
+    double fscanfTime = (wallTime() - start) / repetitions;
+
+    start = wallTime();
+    SourceImage* tokenized = NULL;
+    for(int r = 0; r < repetitions; r++){
+        if(r > 0) freeSourceImage(tokenized);
+        tokenized = readAsciiSourceImage(mapPgm(filename));
+    }
+    double tokenizerTime = (wallTime() - start) / repetitions;
+
+    bool equal = true;
+    withSourceImage(tokenized, [&](auto* image){
+        for(int i = 0; i < reference->iMax; i++){
+            for(int j = 0; j < reference->jMax; j++){
+                if(pixelAt(image, i, j) != pixelAt(reference, i, j)) equal = false;
+            }
+        }
+    });
+
+    printf("%s: %.2lf MB, %d threads\n", filename, megabytes, getThreadCount());
+    printf("fscanf:       %lf segundos\t %.1lf MB/s\n", fscanfTime, megabytes / fscanfTime);
+    printf("Tokenizador:  %lf segundos\t %.1lf MB/s\t (%.1lfx)\n", tokenizerTime, megabytes / tokenizerTime, fscanfTime / tokenizerTime);
+    if(!equal) printf("Error: tokenizer result differs from fscanf\n");
+
+    freeImage(reference);
+    freeSourceImage(tokenized);
+}
+
+/*
+ * Varredura das imagens integrais como era antes da borda zerada: as tabelas têm o
+ * tamanho da imagem e cada acesso fora da imagem é tratado com um teste i == 0 / j == 0.
+ */
+template <typename A>
+VarianceResult* scanIntegralImagesWithBorderTests(Image<A>* sumIntegralImage, Image<A>* pow2IntegralImage, long tSize){
+    double lowestVariance = 9999999999999;
+    int iLowestVariance = -1, jLowestVariance = -1;
+    double windowSize = tSize*tSize;
+    double windowAverage = 0;
+    for(int i = 0; i < sumIntegralImage->iMax - (tSize -1); i++){
+        A* pow2Upper = i == 0 ? NULL : rowAt(pow2IntegralImage, i-1);
+        A* pow2Lower = rowAt(pow2IntegralImage, i-1 + tSize);
+        A* sumUpper = i == 0 ? NULL : rowAt(sumIntegralImage, i-1);
+        A* sumLower = rowAt(sumIntegralImage, i-1 + tSize);
+        for(int j = 0; j < sumIntegralImage->jMax - (tSize -1); j++){
+            double pow2ToVarA = (i == 0 || j == 0 ? 0 : pow2Upper[j-1] );
+            double pow2ToVarB = (i == 0 ? 0 : pow2Upper[(j-1 + tSize)] );
+            double pow2ToVarC = pow2Lower[(j-1 + tSize)];
+            double pow2ToVarD = (j == 0 ? 0 : pow2Lower[j-1] );
+            double pow2ToVar = pow2ToVarC - pow2ToVarB - pow2ToVarD + pow2ToVarA; 
+
+            double sumToAvgA = (i == 0 || j == 0 ? 0 : sumUpper[j-1] );
+            double sumToAvgB = (i == 0 ? 0 : sumUpper[(j-1 + tSize)] );
+            double sumToAvgC = sumLower[(j-1 + tSize)];
+            double sumToAvgD = (j == 0 ? 0 : sumLower[j-1] );
+            double windowSum = sumToAvgC - sumToAvgB - sumToAvgD + sumToAvgA;
+            double windowAvg = windowSum / windowSize;
+            double variance = (pow2ToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
+
+            if(variance < lowestVariance){
+                lowestVariance = variance;
+                windowAverage = windowAvg;
+                iLowestVariance = i;
+                jLowestVariance = j;
+            }
+        }
+    }
+    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
+    varianceResult->windowAverage = windowAverage;
+    varianceResult->iLowestVar = iLowestVariance;
+    varianceResult->jLowestVar = jLowestVariance;
+    varianceResult->lowestVariance = lowestVariance; 
+    varianceResult->tSize = tSize;
+    return varianceResult;
+}
+
+/*
+ * Custo por janela (ns) da varredura das imagens integrais com testes de borda, com a
+ * borda zerada (escalar), com a borda zerada em AVX2, quando disponível, e com as
+ * tabelas módulo 2^32, quando as janelas de até 200 x 200 cabem nelas, e por fim no
+ * modo exato (--exact) sobre a menor dessas tabelas. As tabelas são geradas uma vez
+ * só, fora da medição.
+ */
+template <typename T>
+void benchmarkWindowScan(Image<T>* image, long long maxGray, int repetitions){
+    typedef typename IntegralType<T>::type A;
+    Image<A>* sum = generateIntegralImage(image, 1);
+    Image<A>* pow2 = generateIntegralImage(image, 2);
+    IntegralImage<A>* bordered = generateMomentsIntegralImage(image, 2);
+    IntegralImage<uint32_t>* modular = NULL;
+    if(getIntegralBound(maxGray, 200, 200, 2) <= UINT32_MAX){
+        modular = generateMomentsIntegralImageAs<uint32_t>(image, 2);
+    }
+    printf("Tabelas: %.1lf MB (%s)", sizeof(A) * bordered->stride * (bordered->iMax + 1) / (1024.0 * 1024.0),
+           modular ? "long long" : "long long, sem módulo 2^32");
+    if(modular) printf(", %.1lf MB (módulo 2^32)", sizeof(uint32_t) * modular->stride * (modular->iMax + 1) / (1024.0 * 1024.0));
+    printf("\n");
+
+    printf("T\t Com testes (ns)\t Borda zerada (ns)\t AVX2 (ns)\t Módulo 2^32 (ns)\t Exato (ns)\n");
+    for(long tSize = 25; tSize <= 200; tSize += 25){
+        if(tSize > image->iMax || tSize > image->jMax) break;
+        double windows = (double) (image->iMax - tSize + 1) * (image->jMax - tSize + 1);
+
+        double start = wallTime();
+        for(int r = 0; r < repetitions; r++){
+            freeLogging(scanIntegralImagesWithBorderTests(sum, pow2, tSize));
+        }
+        double before = (wallTime() - start) / repetitions;
+
+        simdEnabled = false;
+        start = wallTime();
+        for(int r = 0; r < repetitions; r++){
+            freeLogging(scanIntegralImages(bordered, tSize));
+        }
+        double after = (wallTime() - start) / repetitions;
+        simdEnabled = true;
+
+        printf("%ld\t %.3lf\t\t %.3lf\t\t", tSize, before * 1e9 / windows, after * 1e9 / windows);
+        if(canScanWithAvx2(bordered)){
+            start = wallTime();
+            for(int r = 0; r < repetitions; r++){
+                freeLogging(scanIntegralImages(bordered, tSize));
+            }
+            double vectorized = (wallTime() - start) / repetitions;
+            printf(" %.3lf\t", vectorized * 1e9 / windows);
+        } else {
+            printf(" -\t\t");
+        }
+
+        if(modular){
+            start = wallTime();
+            for(int r = 0; r < repetitions; r++){
+                freeLogging(scanIntegralImages(modular, tSize));
+            }
+            double wrapped = (wallTime() - start) / repetitions;
+            printf(" %.3lf\t\t", wrapped * 1e9 / windows);
+        } else {
+            printf(" -\t\t\t");
+        }
+
+        exactVariance = true;
+        start = wallTime();
+        for(int r = 0; r < repetitions; r++){
+            freeLogging(modular ? scanIntegralImages(modular, tSize) : scanIntegralImages(bordered, tSize));
+        }
+        double exact = (wallTime() - start) / repetitions;
+        exactVariance = false;
+        printf(" %.3lf\n", exact * 1e9 / windows);
+    }
+
+    freeImage(sum);
+    freeImage(pow2);
+    freeIntegralImage(bordered);
+    if(modular) freeIntegralImage(modular);
+}
+
+void benchmarkWindow(char* filename, int repetitions){
+    SourceImage* source = readImage(filename);
+    withSourceImage(source, [&](auto* image){
+        printf("%s: %d x %d\n", filename, image->jMax, image->iMax);
+        benchmarkWindowScan(image, source->maxGray, repetitions);
+    });
+    freeSourceImage(source);
+}
+
+/*
+ * Gerador pseudoaleatório (xorshift64) determinístico para as imagens sintéticas.
+ */
+unsigned long long nextRandom(unsigned long long* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ * Imagem sintética iMax x jMax: um gradiente suave com blocos de intensidades diferentes,
+ * somado a um ruído uniforme de amplitude "noise" (em níveis de cinza) e limitado a
+ * [0, maxGray].
+ */
+template <typename T>
+Image<T>* generateSyntheticImage(int iMax, int jMax, long long maxGray, double noise, unsigned long long seed){
+    Image<T>* image = allocateImage<T>(iMax, jMax);
+    unsigned long long state = seed ? seed : 88172645463325252ULL;
+    for(int i = 0; i < iMax; i++){
+        T* row = rowAt(image, i);
+        for(int j = 0; j < jMax; j++){
+            double base = maxGray * (0.25 + 0.5 * ((i / 64 + j / 64) % 4) / 3.0);
+            double random = (nextRandom(&state) % 1000000) / 1000000.0 - 0.5;
+            double value = base + 2 * noise * random;
+            if(value < 0) value = 0;
+            if(value > maxGray) value = maxGray;
+            row[j] = (T) value;
+        }
+    }
+    return image;
+}
+
+/*
+ * Escalabilidade da varredura das imagens integrais (todos os tamanhos de 25 a 200)
+ * de 1 até o número de núcleos da máquina, sobre uma imagem sintética size x size.
+ * Confere que os resultados com várias threads são idênticos aos com uma thread.
+ */
+void benchmarkThreads(int size, int repetitions){
+    Image<uint8_t>* image = generateSyntheticImage<uint8_t>(size, size, 255, 20, 0);
+    IntegralImage<long long>* integral = generateMomentsIntegralImage(image, 2);
+    long tSizes[] = {25, 50, 75, 100, 125, 150, 175, 200};
+    int tSizeCount = 8;
+    VarianceResult reference[8], results[8];
+
+    int maxThreads = std::thread::hardware_concurrency();
+    if(maxThreads < 1) maxThreads = 1;
+    printf("Imagem sintética %d x %d, %d núcleos\n", size, size, maxThreads);
+    printf("Threads\t Tempo (s)\t Speedup\n");
+    double serialTime = 0;
+    for(int threads = 1; threads <= maxThreads; threads = threads < maxThreads ? MIN(threads * 2, maxThreads) : threads + 1){
+        threadCount = threads;
+        double start = wallTime();
+        for(int r = 0; r < repetitions; r++){
+            scanIntegralImagesForAllSizes(integral, tSizes, tSizeCount, threads == 1 ? reference : results);
+        }
+        double elapsed = (wallTime() - start) / repetitions;
+        if(threads == 1) serialTime = elapsed;
+
+        bool equal = threads == 1 || memcmp(reference, results, sizeof(reference)) == 0;
+        printf("%d\t %lf\t %.2lfx%s\n", threads, elapsed, serialTime / elapsed, equal ? "" : "\t Error: differs from 1 thread");
+    }
+    threadCount = 0;
+
+    freeIntegralImage(integral);
+    freeImage(image);
+}
+
+/*
+ * Checksum das células (sem a borda) de um momento, na ordem das linhas, para
+ * comparar construtores sem manter duas imagens integrais grandes na memória. As
+ * somas são tomadas módulo 2^32 quando a tabela é módulo 2^32.
+ */
+template <typename A>
+unsigned long long checksumIntegral(IntegralImage<A>* integral, int moment){
+    unsigned long long checksum = 0;
+    for(int i = 1; i <= integral->iMax; i++){
+        A* row = integralRowAt(integral, i);
+        for(int j = 1; j <= integral->jMax; j++){
+            checksum = checksum * 1099511628211ULL + (unsigned long long) integralCell(integral, row, j)[moment];
+        }
+    }
+    return checksum;
+}
+
+unsigned long long checksumImage(Image<long long>* image, bool modular){
+    unsigned long long checksum = 0;
+    for(int i = 0; i < image->iMax; i++){
+        long long* row = rowAt(image, i);
+        for(int j = 0; j < image->jMax; j++){
+            checksum = checksum * 1099511628211ULL + (modular ? (uint32_t) row[j] : (unsigned long long) row[j]);
+        }
+    }
+    return checksum;
+}
+
+/*
+ * Mede um construtor da imagem integral fundida (tabela de A) e confere o resultado
+ * com os checksums das duas imagens separadas.
+ */
+template <typename A>
+void benchmarkFusedBuild(Image<uint8_t>* image, char const* name, int repetitions, unsigned long long* reference){
+    double start = wallTime();
+    bool equal = true;
+    for(int r = 0; r < repetitions; r++){
+        IntegralImage<A>* integral = generateMomentsIntegralImageAs<A>(image, 2);
+        if(r == 0){
+            equal = checksumIntegral(integral, 0) == reference[0] && checksumIntegral(integral, 1) == reference[1];
+        }
+        freeIntegralImage(integral);
+    }
+    double elapsed = (wallTime() - start) / repetitions;
+    printf("%-32s %lf\t %.3lf%s\n", name, elapsed, elapsed * 1e9 / ((double) image->iMax * image->jMax),
+           equal ? "" : "\t Error: differs from generateIntegralImage");
+}
+
+/*
+ * Construção das imagens integrais de soma e soma dos quadrados de uma imagem
+ * sintética de 8 bits size x size: as duas imagens separadas (generateIntegralImage),
+ * e a versão fundida escalar, com a soma de prefixos AVX2 e paralela (duas passadas,
+ * com a primeira em AVX2), nas tabelas de long long e nas módulo 2^32 que as imagens
+ * de 8 bits usam. Cada construtor é medido e liberado antes do próximo, então o pico
+ * de memória é o de uma só construção.
+ */
+void benchmarkBuild(int size, int repetitions){
+    Image<uint8_t>* image = generateSyntheticImage<uint8_t>(size, size, 255, 20, 0);
+    double pixels = (double) size * size;
+    int parallelThreads = MAX((int) std::thread::hardware_concurrency(), 2);
+    threadCount = 1;
+    printf("Imagem sintética %d x %d\n", size, size);
+    printf("%-34s Tempo (s)\t ns/pixel\n", "Construção");
+
+    double start = wallTime();
+    unsigned long long reference[2], modularReference[2];
+    for(int r = 0; r < repetitions; r++){
+        for(int moment = 0; moment < 2; moment++){
+            Image<long long>* sums = generateIntegralImage(image, moment + 1);
+            if(r == 0){
+                reference[moment] = checksumImage(sums, false);
+                modularReference[moment] = checksumImage(sums, true);
+            }
+            freeImage(sums);
+        }
+    }
+    double elapsed = (wallTime() - start) / repetitions;
+    printf("%-32s %lf\t %.3lf\n", "Duas imagens", elapsed, elapsed * 1e9 / pixels);
+
+    char parallelName[64];
+    snprintf(parallelName, sizeof(parallelName), "Paralela (%d threads)", parallelThreads);
+    for(int modular = 0; modular < 2; modular++){
+        for(int builder = 0; builder < 3; builder++){
+            char name[128];
+            snprintf(name, sizeof(name), "%s %s", modular ? "uint32" : "long long",
+                     builder == 0 ? "escalar" : builder == 1 ? "AVX2" : parallelName);
+            if(builder > 0 && !hasAvx2()){
+                printf("%-32s Error: AVX2 not supported by this processor\n", name);
+                continue;
+            }
+            simdEnabled = builder > 0;
+            threadCount = builder == 2 ? parallelThreads : 1;
+            if(modular) benchmarkFusedBuild<uint32_t>(image, name, repetitions, modularReference);
+            else benchmarkFusedBuild<long long>(image, name, repetitions, reference);
+        }
+    }
+    simdEnabled = true;
+    threadCount = 0;
+
+    freeImage(image);
+}
+
+/*
+ * Curvas de escalabilidade de todos os métodos sobre imagens sintéticas quadradas de
+ * 256 x 256 até maxSize x maxSize (dobrando o lado), em 8 e 16 bits, com ruído de
+ * "noise" por cento de maxGray. Cada linha do CSV é a mediana de "repetitions"
+ * execuções de um método para um lado e um tamanho de janela; "build" é a geração da
+ * imagem integral (t = 0) e "multiscale" é a varredura única de todos os tamanhos
+ * juntos (também t = 0, sem divisão por tamanho). Os métodos ingênuos custam O(n t²) e só são medidos enquanto
+ * pixels * t² não passa de SCALING_NAIVE_WORK.
+ */
+#define SCALING_MIN_SIZE 256
+#define SCALING_NAIVE_WORK 2e9
+long scalingTSizes[] = {8, 16, 32, 64, 128, 256};
+int scalingTSizeCount = 6;
+
+void printScalingRow(char const* engine, int bits, int size, long tSize, double noise, double* samples, int repetitions, VarianceResult* result){
+    TimingStats stats = getTimingStats(samples, repetitions);
+    printf("%s,%d,%d,%ld,%g,%.9lf,%.9lf,%.9lf,%d,%.3lf", engine, bits, size, tSize, noise,
+        stats.median, stats.min, stats.stddev, repetitions, stats.median * 1e9 / ((double) size * size));
+    if(result) printf(",%.17g,%d,%d\n", result->lowestVariance, result->iLowestVar, result->jLowestVar);
+    else printf(",,,\n");
+    fflush(stdout);
+}
+
+template <typename T, typename A>
+void benchmarkScalingEngines(VarianceWorkspace<T, A>* workspace, int bits, double noise, int repetitions){
+    Image<T>* image = workspace->source;
+    int size = image->iMax;
+    int tSizeCount = workspace->tSizeCount;
+    double* samples = (double*) mallocLogging(sizeof(double) * repetitions);
+    char const* engines[] = {"twice", "once", "integral", "exact", "sliding"};
+    VarianceResult result;
+
+    for(int r = 0; r < repetitions; r++){
+        rebuildWorkspaceIntegral(workspace);
+        samples[r] = workspace->buildTime;
+    }
+    printScalingRow("build", bits, size, 0, noise, samples, repetitions, NULL);
+
+    // A varredura em várias escalas não separa o tempo de cada tamanho
+    for(int r = 0; r < repetitions; r++){
+        getVarianceForAllSizes(workspace);
+        samples[r] = workspace->scanTime + workspace->reduceTime;
+    }
+    printScalingRow("multiscale", bits, size, 0, noise, samples, repetitions, NULL);
+
+    for(int k = 0; k < tSizeCount; k++){
+        long tSize = workspace->tSizes[k];
+        bool naive = (double) size * size * tSize * tSize <= SCALING_NAIVE_WORK;
+        for(int e = 0; e < 5; e++){
+            if(e < 2 && !naive) continue;
+            for(int r = 0; r < repetitions; r++){
+                exactVariance = e == 3;
+                double start = getWallTime();
+                VarianceResult* engineResult =
+                    e == 0 ? getVarianceAccessingTwice(image, tSize) :
+                    e == 1 ? getVarianceAccessingOnce(image, tSize) :
+                    e == 4 ? getVarianceUsingSlidingWindow<A, T>(image, tSize) :
+                    getVarianceUsingWorkspace(workspace, k);
+                samples[r] = getWallTime() - start;
+                result = *engineResult;
+                if(e < 2 || e == 4) freeLogging(engineResult);
+            }
+            exactVariance = false;
+            printScalingRow(engines[e], bits, size, tSize, noise, samples, repetitions, &result);
+        }
+    }
+    freeLogging(samples);
+}
+
+template <typename T>
+void benchmarkScalingImage(int size, int bits, double noise, int repetitions){
+    long long maxGray = (1LL << bits) - 1;
+    Image<T>* image = generateSyntheticImage<T>(size, size, maxGray, noise / 100 * maxGray, 0);
+    int tSizeCount = 0;
+    while(tSizeCount < scalingTSizeCount && scalingTSizes[tSizeCount] <= size) tSizeCount++;
+    withIntegralType(image, maxGray, 2, scalingTSizes[tSizeCount - 1], [&](auto* accumulator){
+        auto* workspace = createVarianceWorkspace(image, accumulator, scalingTSizes, tSizeCount);
+        benchmarkScalingEngines(workspace, bits, noise, repetitions);
+        freeVarianceWorkspace(workspace);
+    });
+    freeImage(image);
+    releaseArenaCache();
+}
+
+void benchmarkScaling(int maxSize, int repetitions, double noise){
+    if(maxSize < SCALING_MIN_SIZE){
+        printf("Error: Invalid size. It should be at least %d\n", SCALING_MIN_SIZE);
+        exit(1);
+    }
+    printf("engine,bits,size,t,noise,median,min,stddev,repetitions,ns_per_pixel,variance,i,j\n");
+    for(int size = SCALING_MIN_SIZE; size <= maxSize; size *= 2){
+        benchmarkScalingImage<uint8_t>(size, 8, noise, repetitions);
+        benchmarkScalingImage<uint16_t>(size, 16, noise, repetitions);
+    }
+}
+
+/*
+ * Confere getTopVarianceWindows contra a supressão gulosa sobre a lista completa de
+ * janelas (todas as posições ordenadas por variância), para vários tamanhos, K e
+ * espaçamentos sobre a imagem dada. Termina com erro se alguma combinação diferir.
+ */
+template <typename A>
+int countTopDifferences(IntegralImage<A>* integral, long tSize, int k, long spacing){
+    int iCount = integral->iMax - (tSize -1), jCount = integral->jMax - (tSize -1);
+    if(iCount < 1 || jCount < 1) return 0;
+    CandidateHeap* all = createCandidateHeap((long) iCount * jCount);
+    for(int i = 0; i < iCount; i++){
+        collectIntegralRowCandidates(integral, i, tSize, all);
+    }
+    qsort(all->items, all->count, sizeof(WindowCandidate), compareCandidates);
+    WindowCandidate* expected = (WindowCandidate*) mallocLogging(sizeof(WindowCandidate) * k);
+    int expectedCount = 0;
+    for(int c = 0; c < all->count && expectedCount < k; c++){
+        bool suppressed = false;
+        for(int a = 0; a < expectedCount && !suppressed; a++){
+            suppressed = labs((long) all->items[c].i - expected[a].i) < spacing && labs((long) all->items[c].j - expected[a].j) < spacing;
+        }
+        if(!suppressed) expected[expectedCount++] = all->items[c];
+    }
+
+    TopVarianceResult* result = getTopVarianceWindows(integral, tSize, k, spacing, spacing);
+    // Os heaps limitados podem aceitar menos janelas, mas nunca janelas diferentes
+    int differences = result->count <= expectedCount ? 0 : 1;
+    for(int w = 0; w < MIN(result->count, expectedCount); w++){
+        if(result->windows[w].i != expected[w].i || result->windows[w].j != expected[w].j) differences++;
+    }
+    printf("%ld\t %d\t %ld\t %d/%d\t %s\n", tSize, k, spacing, result->count, expectedCount,
+           differences ? "Error: differs from brute-force suppression" : "OK");
+    freeTopVarianceResult(result);
+    freeLogging(expected);
+    freeCandidateHeap(all);
+    return differences;
+}
+
+void benchmarkTop(char* filename){
+    SourceImage* source = readImage(filename);
+    long tSizes[] = {5, 25, 50};
+    int ks[] = {1, 10, 50};
+    int differences = 0;
+    printf("T\t K\t Espaçamento\t Janelas\t Resultado\n");
+    withSourceImage(source, [&](auto* image){
+        withIntegralType(image, source->maxGray, 2, 50, [&](auto* accumulator){
+            typedef typename std::remove_pointer<decltype(accumulator)>::type A;
+            IntegralImage<A>* integral = generateMomentsIntegralImageAs<A>(image, 2);
+            for(long tSize : tSizes){
+                for(int k : ks){
+                    for(long spacing : {1L, tSize / 2 + 1, tSize}){
+                        differences += countTopDifferences(integral, tSize, k, spacing);
+                    }
+                }
+            }
+            freeIntegralImage(integral);
+        });
+    });
+    freeSourceImage(source);
+    if(differences) exit(1);
+}
+
+int main(int argc, char * argv[]){
+    if(argc < 3){
+        printf("Use: './benchmark <parse|window|top> filename.pgm [repetitions]' or './benchmark <threads|build> size [repetitions]' or './benchmark scaling maxSize [repetitions] [noise]'\n");
+        exit(1);
+    }
+    int repetitions = argc > 3 ? atoi(argv[3]) : 5;
+    if(repetitions < 1) repetitions = 1;
+
+    if(strcmp(argv[1], "parse") == 0){
+        benchmarkParse(argv[2], repetitions);
+    } else if(strcmp(argv[1], "window") == 0){
+        benchmarkWindow(argv[2], repetitions);
+    } else if(strcmp(argv[1], "threads") == 0){
+        benchmarkThreads(atoi(argv[2]), repetitions);
+    } else if(strcmp(argv[1], "build") == 0){
+        benchmarkBuild(atoi(argv[2]), repetitions);
+    } else if(strcmp(argv[1], "top") == 0){
+        benchmarkTop(argv[2]);
+    } else if(strcmp(argv[1], "scaling") == 0){
+        benchmarkScaling(atoi(argv[2]), repetitions, argc > 4 ? atof(argv[4]) : 5);
+    } else {
+        printf("Error: Unknown benchmark %s.\n", argv[1]);
+        exit(1);
+    }
+    destroyThreadPool();
+    return 0;
+}
@@ -1,83 +1,749 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <immintrin.h>
 
 #define MIN(x, y) ((x < y) ? x : y)
+#define MAX(x, y) ((x > y) ? x : y)
 
 bool debugVerbose = false;
 bool debugSimple = false;
+int threadCount = 0; // 0 = número de núcleos da máquina
+bool simdEnabled = true; // usa AVX2 quando o processador suporta
+bool exactVariance = false; // compara as janelas com inteiros (--exact)
+long windowWidth = 0; // largura das janelas (--width), 0 = quadradas t x t
+int iStride = 1; // passo entre os cantos das janelas avaliadas (--stride)
+int jStride = 1;
+
+/*
+ * O tamanho t dos argumentos é a altura da janela; a largura é t, a não ser que
+ * --width fixe outra. Todos os algoritmos só avaliam as janelas com canto (i, j) em
+ * i múltiplo de iStride e j múltiplo de jStride.
+ */
+inline long getWindowWidth(long tSize){
+    return windowWidth > 0 ? windowWidth : tSize;
+}
 
 /* ------------------------------------------ UTILS MALLOC / FREE -----------------------------------
  * Funções auxiliares para malloc e free. Elas servem para um ter um controle a mais 
  * das funções com gerenciamento de memória para garantir que não existem ponteiros 
- * pendentes
+ * pendentes.
+ *
+ * Os blocos vêm de uma arena que os reaproveita, já que a varredura com vários
+ * tamanhos (e o modo --batch) aloca e libera os mesmos objetos a cada repetição:
+ * - Blocos pequenos (até ARENA_SMALL_LIMIT bytes) são separados em classes de 64
+ *   bytes, cortados de pedaços de ARENA_CHUNK_BYTES, e voltam para a lista livre da
+ *   sua classe no freeLogging; os pedaços nunca são devolvidos ao sistema.
+ * - Blocos grandes (imagens, tabelas, janelas) vêm do sistema e, quando liberados,
+ *   ficam guardados (até ARENA_MAX_CACHED_BYTES no total) para o próximo pedido de
+ *   tamanho parecido, sem um novo mmap nem as faltas de página de memória nova.
+ * Todo bloco começa com um cabeçalho de ARENA_ALIGNMENT bytes, então todos os
+ * endereços são alinhados em 64 bytes. A arena é protegida por um mutex, pois as
+ * faixas paralelas e a leitura do modo --batch também alocam.
+ *
+ * A contagem de ponteiros pendentes continua nas estatísticas da arena, junto com
+ * os bytes em uso, o pico e o número de alocações (veja printArenaStats).
+ */
+#define ARENA_ALIGNMENT 64
+#define ARENA_SMALL_LIMIT 4096
+#define ARENA_SIZE_CLASSES (ARENA_SMALL_LIMIT / ARENA_ALIGNMENT)
+#define ARENA_CHUNK_BYTES (1 << 20)
+#define ARENA_MAX_CACHED_BYTES (256L << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next; // próximo bloco livre da mesma lista
+    size_t size;             // bytes utilizáveis depois do cabeçalho
+    size_t requested;        // bytes pedidos na alocação atual
+    int sizeClass;           // -1 para os blocos grandes
+} ArenaBlock;
+
+typedef struct {
+    std::mutex mutex;
+    ArenaBlock* freeSmall[ARENA_SIZE_CLASSES];
+    ArenaBlock* freeLarge;
+    size_t cachedLargeBytes;
+    unsigned char* chunk; // pedaço atual dos blocos pequenos
+    size_t chunkUsed;
+    size_t bytesInUse;
+    size_t peakBytes;
+    long allocationCount;
+    long reusedCount;
+    int pendingCount;
+} Arena;
+
+Arena arena = {};
+
+inline ArenaBlock* getArenaBlock(void* var){
+    return (ArenaBlock*) ((unsigned char*) var - ARENA_ALIGNMENT);
+}
+
+ArenaBlock* takeSmallArenaBlock(int sizeClass){
+    ArenaBlock* block = arena.freeSmall[sizeClass];
+    if(block){
+        arena.freeSmall[sizeClass] = block->next;
+        arena.reusedCount++;
+        return block;
+    }
+    size_t blockBytes = ARENA_ALIGNMENT + (size_t) (sizeClass + 1) * ARENA_ALIGNMENT;
+    if(!arena.chunk || arena.chunkUsed + blockBytes > ARENA_CHUNK_BYTES){
+        void* chunk = NULL;
+        if(posix_memalign(&chunk, ARENA_ALIGNMENT, ARENA_CHUNK_BYTES) != 0) return NULL;
+        arena.chunk = (unsigned char*) chunk;
+        arena.chunkUsed = 0;
+    }
+    block = (ArenaBlock*) (arena.chunk + arena.chunkUsed);
+    arena.chunkUsed += blockBytes;
+    block->size = (size_t) (sizeClass + 1) * ARENA_ALIGNMENT;
+    block->sizeClass = sizeClass;
+    return block;
+}
+
+/*
+ * O menor bloco grande guardado que serve para "size" sem desperdiçar mais de um
+ * quarto dele, ou um bloco novo do sistema.
  */
-int pendingAdressesCount = 0;
+ArenaBlock* takeLargeArenaBlock(size_t size){
+    ArenaBlock** best = NULL;
+    for(ArenaBlock** link = &arena.freeLarge; *link; link = &(*link)->next){
+        size_t blockSize = (*link)->size;
+        if(blockSize >= size && blockSize - size <= blockSize / 4 && (!best || blockSize < (*best)->size)){
+            best = link;
+        }
+    }
+    if(best){
+        ArenaBlock* block = *best;
+        *best = block->next;
+        arena.cachedLargeBytes -= block->size;
+        arena.reusedCount++;
+        return block;
+    }
+    void* memory = NULL;
+    if(posix_memalign(&memory, ARENA_ALIGNMENT, ARENA_ALIGNMENT + size) != 0) return NULL;
+    ArenaBlock* block = (ArenaBlock*) memory;
+    block->size = size;
+    block->sizeClass = -1;
+    return block;
+}
+
 void* mallocLogging(size_t size){
-    void* mallocResult = malloc(size);
-    if(debugVerbose) printf("Allocated \"%d\". Address: \"%p\" \n", size, mallocResult);
-    pendingAdressesCount++;
+    void* mallocResult;
+    {
+        std::lock_guard<std::mutex> lock(arena.mutex);
+        int sizeClass = size > ARENA_SMALL_LIMIT ? -1 : size > 0 ? (int) ((size - 1) / ARENA_ALIGNMENT) : 0;
+        ArenaBlock* block = sizeClass >= 0 ? takeSmallArenaBlock(sizeClass) : takeLargeArenaBlock(size);
+        if(!block){
+            printf("Error: Out of memory allocating %zu bytes.\n", size);
+            exit(1);
+        }
+        block->requested = size;
+        arena.bytesInUse += size;
+        if(arena.bytesInUse > arena.peakBytes) arena.peakBytes = arena.bytesInUse;
+        arena.allocationCount++;
+        arena.pendingCount++;
+        mallocResult = (unsigned char*) block + ARENA_ALIGNMENT;
+    }
+    if(debugVerbose) printf("Allocated \"%zu\". Address: \"%p\" \n", size, mallocResult);
     return mallocResult;
 }
 
+/*
+ * Igual ao mallocLogging, mas com o endereço alinhado em "alignment" bytes.
+ * Deve ser liberado com freeLogging. Todos os blocos da arena já são alinhados em
+ * ARENA_ALIGNMENT bytes, o maior alinhamento usado pelo programa.
+ */
+void* mallocAlignedLogging(size_t alignment, size_t size){
+    if(alignment > ARENA_ALIGNMENT || ARENA_ALIGNMENT % alignment != 0){
+        printf("Error: Alignment %zu is not supported by the arena.\n", alignment);
+        exit(1);
+    }
+    return mallocLogging(size);
+}
+
 void freeLogging(void* var){
-    free(var);
+    if(!var) return;
+    {
+        std::lock_guard<std::mutex> lock(arena.mutex);
+        ArenaBlock* block = getArenaBlock(var);
+        arena.bytesInUse -= block->requested;
+        arena.pendingCount--;
+        if(block->sizeClass >= 0){
+            block->next = arena.freeSmall[block->sizeClass];
+            arena.freeSmall[block->sizeClass] = block;
+        } else if(arena.cachedLargeBytes + block->size <= ARENA_MAX_CACHED_BYTES){
+            block->next = arena.freeLarge;
+            arena.freeLarge = block;
+            arena.cachedLargeBytes += block->size;
+        } else {
+            free(block);
+        }
+    }
     if(debugVerbose) printf("Deallocated address: \"%p\" \n", var);
-    pendingAdressesCount--;
 }
 
-// ------------------------------------------ MATRIX/ARRAY UTILS ------------------------------------------
+/*
+ * Devolve ao sistema os blocos grandes guardados, por exemplo no fim do programa.
+ */
+void releaseArenaCache(){
+    std::lock_guard<std::mutex> lock(arena.mutex);
+    while(arena.freeLarge){
+        ArenaBlock* block = arena.freeLarge;
+        arena.freeLarge = block->next;
+        free(block);
+    }
+    arena.cachedLargeBytes = 0;
+}
+
+void printArenaStats(){
+    printf("Arena: %zu bytes in use, peak %zu bytes, %ld allocations (%ld reused)\n",
+        arena.bytesInUse, arena.peakBytes, arena.allocationCount, arena.reusedCount);
+}
+
+// ------------------------------------------ THREAD UTILS ------------------------------------------
+int getThreadCount(){
+    if(threadCount > 0) return threadCount;
+    int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+/*
+ * Conjunto de threads persistentes, criado no primeiro uso com getThreadCount() - 1
+ * threads (a thread chamadora também trabalha). Cada chamada de runInParallel publica
+ * um "job" com taskCount tarefas e as threads pegam a próxima tarefa livre até
+ * acabarem, então tarefas em número maior que o de threads são balanceadas sozinhas.
+ */
+typedef struct {
+    std::thread* workers;
+    int workerCount;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)>* job;
+    int jobTaskCount;
+    std::atomic<int> nextTask;
+    int activeWorkers;
+    long generation;
+    bool stopping;
+    std::atomic<bool> busy;
+} ThreadPool;
+
+ThreadPool* threadPool = NULL;
+
+// Tarefas por thread ao dividir um trabalho em faixas, para balancear a carga
+#define SCAN_BANDS_PER_THREAD 4
+
+void runPoolTasks(ThreadPool* pool){
+    int task;
+    while((task = pool->nextTask++) < pool->jobTaskCount){
+        (*pool->job)(task);
+    }
+}
+
+void threadPoolWorker(ThreadPool* pool){
+    long seenGeneration = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wake.wait(lock, [&]{ return pool->stopping || pool->generation != seenGeneration; });
+            if(pool->stopping) return;
+            seenGeneration = pool->generation;
+        }
+        runPoolTasks(pool);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if(--pool->activeWorkers == 0) pool->done.notify_one();
+    }
+}
+
+void destroyThreadPool(){
+    if(!threadPool) return;
+    {
+        std::lock_guard<std::mutex> lock(threadPool->mutex);
+        threadPool->stopping = true;
+    }
+    threadPool->wake.notify_all();
+    for(int t = 0; t < threadPool->workerCount; t++){
+        threadPool->workers[t].join();
+    }
+    delete[] threadPool->workers;
+    delete threadPool;
+    threadPool = NULL;
+}
+
+ThreadPool* getThreadPool(){
+    int workerCount = getThreadCount() - 1;
+    if(threadPool && threadPool->workerCount != workerCount) destroyThreadPool();
+    if(!threadPool){
+        threadPool = new ThreadPool();
+        threadPool->workerCount = workerCount;
+        threadPool->generation = 0;
+        threadPool->stopping = false;
+        threadPool->busy = false;
+        threadPool->workers = new std::thread[workerCount > 0 ? workerCount : 1];
+        for(int t = 0; t < workerCount; t++){
+            threadPool->workers[t] = std::thread(threadPoolWorker, threadPool);
+        }
+    }
+    return threadPool;
+}
+
+/*
+ * Executa task(0) ... task(taskCount - 1) no conjunto de threads e espera todas
+ * terminarem. Se o conjunto já estiver ocupado com outra chamada (de outra thread),
+ * as tarefas rodam em sequência na própria thread chamadora.
+ */
+template <typename Task>
+void runInParallel(int taskCount, Task task){
+    ThreadPool* pool = taskCount > 1 && getThreadCount() > 1 ? getThreadPool() : NULL;
+    bool expected = false;
+    if(!pool || !pool->busy.compare_exchange_strong(expected, true)){
+        for(int t = 0; t < taskCount; t++) task(t);
+        return;
+    }
+
+    std::function<void(int)> job = task;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->job = &job;
+        pool->jobTaskCount = taskCount;
+        pool->nextTask = 0;
+        pool->activeWorkers = pool->workerCount;
+        pool->generation++;
+    }
+    pool->wake.notify_all();
+    runPoolTasks(pool);
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->done.wait(lock, [&]{ return pool->activeWorkers == 0; });
+    }
+    pool->busy = false;
+}
+
+// ------------------------------------------ SIMD UTILS ------------------------------------------
+/*
+ * As funções vetorizadas são compiladas com __attribute__((target("avx2"))) e só são
+ * chamadas quando o processador suporta AVX2 e simdEnabled está ligado; caso
+ * contrário sempre existe a versão escalar equivalente.
+ */
+bool hasAvx2(){
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+// ------------------------------------------ TIMING UTILS ------------------------------------------
+/*
+ * Tempo de parede em segundos de um relógio monotônico. clock() soma o tempo de CPU
+ * de todas as threads, então não mostra o ganho das versões paralelas.
+ */
+double getWallTime(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Resumo de várias medidas de um mesmo trecho: mediana (robusta a picos do sistema),
+ * mínimo e desvio padrão.
+ */
 typedef struct {
-    long long  *array;
-    long long **matrix;
+    double median;
+    double min;
+    double stddev;
+    int count;
+}TimingStats;
+
+int compareDoubles(const void* a, const void* b){
+    double first = *(double*) a, second = *(double*) b;
+    return (first > second) - (first < second);
+}
+
+TimingStats getTimingStats(double* samples, int count){
+    TimingStats stats = {0, 0, 0, count};
+    if(count <= 0) return stats;
+    double* sorted = (double*) mallocLogging(sizeof(double) * count);
+    memcpy(sorted, samples, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compareDoubles);
+    stats.median = count % 2 == 1 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+    stats.min = sorted[0];
+    double mean = 0;
+    for(int s = 0; s < count; s++) mean += sorted[s];
+    mean /= count;
+    for(int s = 0; s < count; s++) stats.stddev += (sorted[s] - mean) * (sorted[s] - mean);
+    stats.stddev = sqrt(stats.stddev / count);
+    freeLogging(sorted);
+    return stats;
+}
+
+// ------------------------------------------ MATRIX/ARRAY UTILS ------------------------------------------
+/*
+ * Imagem genérica no tipo do pixel T. As imagens de origem mantêm a largura nativa
+ * do arquivo (uint8_t para maxGray até 255, por exemplo) e somente as imagens
+ * integrais usam acumuladores largos (long long). Quando ownsArray é falso, o array
+ * pertence a outra estrutura (o arquivo mapeado, por exemplo) e não é liberado aqui.
+ *
+ * Os pixels ficam em um único buffer, linha após linha, e a linha i começa em
+ * array + i * stride. Nas imagens alocadas aqui o buffer é alinhado em 64 bytes e
+ * stride é arredondado para que toda linha também comece alinhada. Sem a tabela de
+ * ponteiros por linha, o acesso a um pixel é só uma conta de endereço e os laços
+ * internos sobre uma linha podem ser vetorizados pelo compilador.
+ */
+#define IMAGE_ALIGNMENT 64
+
+template <typename T>
+struct Image {
+    T  *array;
+    long stride;
     int iMax;
     int jMax;
-}Image;
+    bool ownsArray;
+};
+
+template <typename T>
+inline T* rowAt(Image<T>* image, int i){
+    return image->array + i * image->stride;
+}
+
+template <typename T>
+inline T& pixelAt(Image<T>* image, int i, int j){
+    return image->array[i * image->stride + j];
+}
+
+template <typename T>
+void printPixel(T pixel){
+    printf("%lld\t", (long long) pixel);
+}
 
-void printImage(Image* image){
+void printPixel(double pixel){
+    printf("%lf\t", pixel);
+}
+
+template <typename T>
+void printImage(Image<T>* image){
     printf("Size: %d x %d\n", image->iMax, image->jMax);
     for (int i = 0; i < image->iMax; i++){
         printf("%d: [", i);
         for (int j = 0; j < image->jMax; j++){
-            printf("%lld\t", image->matrix[i][j]);
+            printPixel(pixelAt(image, i, j));
         }
         printf("]\n");
     }
 }
 
-Image* allocateImage(int iMax, int jMax){
-    long long *array;
-    array = (long long*) mallocLogging(sizeof(long long)*iMax*jMax);
-    
-    
-    long long **matrixPointers;
-    matrixPointers = (long long**) mallocLogging(sizeof(long long*)*iMax);
-    
-    for(int i = 0; i < iMax; i++){
-        matrixPointers[i] = &array[i*jMax] ;
-    }
-    Image *image = (Image*) mallocLogging(sizeof(Image));
+/*
+ * Cria a imagem sobre um array já existente, sem copiá-lo.
+ */
+template <typename T>
+Image<T>* wrapImage(T* array, int iMax, int jMax, long stride){
+    Image<T> *image = (Image<T>*) mallocLogging(sizeof(Image<T>));
     image->array = array;
-    image->matrix = matrixPointers;
+    image->stride = stride;
     image->iMax = iMax;
     image->jMax = jMax; 
+    image->ownsArray = false;
     return image;
 }
 
-void freeImage(Image* image){
-    freeLogging(image->matrix);
-    freeLogging(image->array);
+template <typename T>
+Image<T>* allocateImage(int iMax, int jMax){
+    long rowBytes = sizeof(T) * jMax;
+    rowBytes = (rowBytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    long stride = rowBytes / sizeof(T);
+
+    T *array;
+    array = (T*) mallocAlignedLogging(IMAGE_ALIGNMENT, rowBytes * (iMax > 0 ? iMax : 1));
+    
+    Image<T> *image = wrapImage(array, iMax, jMax, stride);
+    image->ownsArray = true;
+    return image;
+}
+
+template <typename T>
+void freeImage(Image<T>* image){
+    if(image->ownsArray) freeLogging(image->array);
     freeLogging(image);
 }
 
+/*
+ * Tipo dos acumuladores das imagens integrais para cada tipo de pixel.
+ */
+template <typename T> struct IntegralType { typedef long long type; };
+template <> struct IntegralType<double> { typedef double type; };
+
 /* ------------------------------------------ IMAGE UTILS ------------------------------------------
  * Funções auxiliares para leitura da imagem
  */
-Image* readImage(char* filename){
-    if(debugVerbose) printf("Reading %s\n", filename);
 
+/*
+ * Arquivo PGM mapeado em memória com mmap. O cabeçalho é interpretado diretamente
+ * sobre a região mapeada e "pixels" aponta para o primeiro byte do corpo, sem
+ * nenhuma cópia intermediária do arquivo.
+ */
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    char version[3];
+    int iMax;
+    int jMax;
+    long long maxGray;
+    unsigned char* pixels;
+}MappedPgm;
+
+/*
+ * Falha na leitura de um arquivo: como os demais erros, imprime "Error: ..." e termina
+ * o programa, a não ser que a thread atual tenha ligado recoverReadErrors (a thread
+ * de leitura do --batch, para que um arquivo ruim não derrube o lote). Nesse caso a
+ * mensagem fica em readErrorMessage e a função de leitura libera o que já tinha
+ * alocado e devolve NULL (ou false). As tarefas de runInParallel rodam em outras
+ * threads, então elas devolvem o erro para a thread que as chamou.
+ */
+thread_local bool recoverReadErrors = false;
+thread_local char readErrorMessage[512];
+
+void failRead(char const* format, ...){
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(readErrorMessage, sizeof(readErrorMessage), format, arguments);
+    va_end(arguments);
+    if(recoverReadErrors) return;
+    printf("Error: %s\n", readErrorMessage);
+    exit(1);
+}
+
+bool isPgmSpace(unsigned char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+ * Lê um inteiro do cabeçalho a partir de "offset", pulando espaços e comentários (#).
+ * Devolve -1 se o cabeçalho for inválido (veja failRead).
+ */
+long long readPgmHeaderNumber(MappedPgm* pgm, size_t* offset){
+    size_t pos = *offset;
+    while(pos < pgm->size && (isPgmSpace(pgm->data[pos]) || pgm->data[pos] == '#')){
+        if(pgm->data[pos] == '#'){
+            while(pos < pgm->size && pgm->data[pos] != '\n') pos++;
+        } else {
+            pos++;
+        }
+    }
+    if(pos >= pgm->size || pgm->data[pos] < '0' || pgm->data[pos] > '9'){
+        failRead("Invalid PGM header.");
+        return -1;
+    }
+    long long number = 0;
+    while(pos < pgm->size && pgm->data[pos] >= '0' && pgm->data[pos] <= '9'){
+        // Satura em LLONG_MAX para que valores gigantes sejam rejeitados depois
+        number = number > (LLONG_MAX - 9) / 10 ? LLONG_MAX : number * 10 + (pgm->data[pos] - '0');
+        pos++;
+    }
+    *offset = pos;
+    return number;
+}
+
+/*
+ * As dimensões vão para int (iMax, jMax), então precisam estar em 1..INT_MAX, e cada
+ * pixel ocupa ao menos um byte do arquivo (P5) ou um dígito (P2), então largura x
+ * altura não pode passar do tamanho do arquivo. Sem isso uma largura como 2^32 + 1
+ * viraria 1 silenciosamente.
+ */
+bool checkPgmDimensions(long long width, long long height, long long fileSize){
+    if(width < 1 || width > INT_MAX || height < 1 || height > INT_MAX){
+        failRead("Invalid PGM dimensions %lld x %lld. They should be between 1 and %d.", width, height, INT_MAX);
+        return false;
+    }
+    if(width > fileSize / height){
+        failRead("PGM header says %lld x %lld pixels, more than the %lld bytes of the file.", width, height, fileSize);
+        return false;
+    }
+    return true;
+}
+
+void unmapPgm(MappedPgm* pgm){
+    munmap(pgm->data, pgm->size);
+    freeLogging(pgm);
+}
+
+MappedPgm* mapPgm(char* filename){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        failRead("Unable to open file %s.", filename);
+        return NULL;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0 || fileStat.st_size < 2) {
+        close(fd);
+        failRead("Unable to read file %s.", filename);
+        return NULL;
+    }
+    void* data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        failRead("Unable to map file %s.", filename);
+        return NULL;
+    }
+
+    MappedPgm* pgm = (MappedPgm*) mallocLogging(sizeof(MappedPgm));
+    pgm->data = (unsigned char*) data;
+    pgm->size = fileStat.st_size;
+    pgm->version[0] = pgm->data[0];
+    pgm->version[1] = pgm->data[1];
+    pgm->version[2] = '\0';
+
+    size_t offset = 2;
+    long long width = readPgmHeaderNumber(pgm, &offset);
+    long long height = width < 0 ? -1 : readPgmHeaderNumber(pgm, &offset);
+    if(width < 0 || height < 0 || !checkPgmDimensions(width, height, pgm->size)){
+        unmapPgm(pgm);
+        return NULL;
+    }
+    pgm->jMax = width;
+    pgm->iMax = height;
+    pgm->maxGray = readPgmHeaderNumber(pgm, &offset);
+    if(pgm->maxGray < 0){
+        unmapPgm(pgm);
+        return NULL;
+    }
+    // Exatamente um caractere de espaço separa o cabeçalho dos dados
+    pgm->pixels = pgm->data + offset + 1;
+    return pgm;
+}
+
+/* 
+ * Imagem de origem com o tipo de pixel decidido em tempo de execução pelo cabeçalho
+ * do PGM. "image" aponta para um Image<T> do tipo indicado em "type" e as funções
+ * que processam a imagem são instanciadas para cada T por withSourceImage.
+ */
+typedef enum {
+    PIXEL_UINT8,
+    PIXEL_UINT16,
+    PIXEL_UINT32,
+    PIXEL_INT64,
+    PIXEL_DOUBLE
+}PixelType;
+
+typedef struct {
+    PixelType type;
+    void* image;
+    MappedPgm* mapping; // não nulo quando os pixels apontam direto para o arquivo
+    long long maxGray;
+}SourceImage;
+
+template <typename Function>
+void withSourceImage(SourceImage* source, Function function){
+    switch(source->type){
+        case PIXEL_UINT8:  function((Image<uint8_t>*) source->image); break;
+        case PIXEL_UINT16: function((Image<uint16_t>*) source->image); break;
+        case PIXEL_UINT32: function((Image<uint32_t>*) source->image); break;
+        case PIXEL_INT64:  function((Image<long long>*) source->image); break;
+        case PIXEL_DOUBLE: function((Image<double>*) source->image); break;
+    }
+}
+
+template <typename T>
+SourceImage* createSourceImage(PixelType type, Image<T>* image, long long maxGray){
+    SourceImage* source = (SourceImage*) mallocLogging(sizeof(SourceImage));
+    source->type = type;
+    source->image = image;
+    source->mapping = NULL;
+    source->maxGray = maxGray;
+    return source;
+}
+
+void freeSourceImage(SourceImage* source){
+    withSourceImage(source, [](auto* image){ freeImage(image); });
+    if(source->mapping) unmapPgm(source->mapping);
+    freeLogging(source);
+}
+
+/*
+ * Confere que nenhum pixel de um P5 passa do maxGray do cabeçalho. O tipo das imagens
+ * integrais é escolhido por esse maxGray (withIntegralType), então um pixel acima
+ * dele estouraria as somas sem aviso; o P2 já é conferido pelo tokenizador. Com
+ * maxGray 255 ou 65535 nenhum pixel pode passar e nada é lido.
+ */
+bool checkBinaryPixels(unsigned char* pixels, size_t count, int bytesPerPixel, long long maxGray){
+    if(maxGray == (bytesPerPixel == 1 ? UINT8_MAX : UINT16_MAX)) return true;
+    long long brightest = 0;
+    if(bytesPerPixel == 1){
+        unsigned char largest = 0;
+        for(size_t p = 0; p < count; p++) largest = MAX(largest, pixels[p]);
+        brightest = largest;
+    } else {
+        for(size_t p = 0; p < count; p++){
+            long long pixel = (pixels[2*p] << 8) | pixels[2*p + 1];
+            brightest = MAX(brightest, pixel);
+        }
+    }
+    if(brightest > maxGray){
+        failRead("Pixel %lld is greater than PGM max gray %lld.", brightest, maxGray);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Leitura do formato binário (P5). Cada pixel ocupa 1 byte quando maxGray < 256 e
+ * 2 bytes (big-endian) caso contrário. Para 1 byte por pixel a imagem usa as próprias
+ * páginas mapeadas do arquivo como array, sem nenhuma cópia, e o mapeamento passa a
+ * pertencer à imagem. Para 2 bytes é preciso inverter a ordem dos bytes.
+ */
+SourceImage* readBinaryImage(MappedPgm* pgm){
+    if(pgm->maxGray < 1 || pgm->maxGray > 65535){
+        failRead("Invalid max gray value %lld for binary PGM.", pgm->maxGray);
+        unmapPgm(pgm);
+        return NULL;
+    }
+    int bytesPerPixel = pgm->maxGray < 256 ? 1 : 2;
+    size_t pixelCount = (size_t) pgm->iMax * pgm->jMax;
+    if(pgm->pixels + pixelCount * bytesPerPixel > pgm->data + pgm->size){
+        failRead("Binary PGM is smaller than its header says.");
+        unmapPgm(pgm);
+        return NULL;
+    }
+    if(!checkBinaryPixels(pgm->pixels, pixelCount, bytesPerPixel, pgm->maxGray)){
+        unmapPgm(pgm);
+        return NULL;
+    }
+
+    if(bytesPerPixel == 1){
+        Image<uint8_t>* image = wrapImage<uint8_t>(pgm->pixels, pgm->iMax, pgm->jMax, pgm->jMax);
+        SourceImage* source = createSourceImage(PIXEL_UINT8, image, pgm->maxGray);
+        source->mapping = pgm;
+        return source;
+    }
+
+    Image<uint16_t>* image = allocateImage<uint16_t>(pgm->iMax, pgm->jMax);
+    for(int i = 0; i < image->iMax; i++){
+        unsigned char* pixels = pgm->pixels + 2 * (size_t) i * image->jMax;
+        uint16_t* row = rowAt(image, i);
+        for(int j = 0; j < image->jMax; j++){
+            row[j] = (pixels[2*j] << 8) | pixels[2*j + 1];
+        }
+    }
+    SourceImage* source = createSourceImage(PIXEL_UINT16, image, pgm->maxGray);
+    unmapPgm(pgm);
+    return source;
+}
+
+/*
+ * Leitura do formato ASCII (P2) com fscanf a cada pixel. É a implementação original,
+ * mantida como referência para o benchmark do tokenizador abaixo.
+ */
+Image<long long>* readAsciiImageUsingFscanf(char* filename){
     FILE* file = fopen(filename, "r" );
     if (!file) {
         printf("Error: Unable to open file %s.\n\n", filename);
@@ -92,7 +758,7 @@ Image* readImage(char* filename){
 
     if (debugVerbose) printf("%d %d %d ",col_len, row_len, max_gray);
 
-    Image* image = allocateImage(row_len, col_len);
+    Image<long long>* image = allocateImage<long long>(row_len, col_len);
 
     long long number;
     for(int i = 0; i < image->iMax;i++){
@@ -102,16 +768,190 @@ Image* readImage(char* filename){
                 printf("Error: number from PGM is lower than zero. Maybe PGM file max gray scale is greater than long long?");
                 exit(1);
             }
-            image->matrix[i][j] = number;
+            pixelAt(image, i, j) = number;
         }    
     }
     fclose(file);
     return image;
 }
 
+/*
+ * Tokenizador do corpo de um P2. O arquivo já está inteiro em memória (mapeado), então
+ * o corpo é dividido em um pedaço por thread, sempre cortando em um espaço em branco
+ * para nunca partir um número ao meio. Uma primeira passada conta os números de cada
+ * pedaço para descobrir onde cada um começa na imagem e uma segunda passada converte
+ * os números diretamente para a posição final, ambas em paralelo.
+ */
+long countAsciiTokens(unsigned char* begin, unsigned char* end){
+    long count = 0;
+    bool inToken = false;
+    for(unsigned char* c = begin; c < end; c++){
+        bool space = isPgmSpace(*c);
+        if(!space && !inToken) count++;
+        inToken = !space;
+    }
+    return count;
+}
+
+/*
+ * Erro de um pedaço do corpo, devolvido para a thread que chamou runInParallel.
+ */
+typedef struct {
+    enum { ASCII_OK, ASCII_NEGATIVE, ASCII_INVALID, ASCII_ABOVE_MAX } kind;
+    long long value; // o caractere inválido ou o pixel acima de maxGray
+}AsciiParseError;
+
+template <typename T>
+AsciiParseError parseAsciiTokens(unsigned char* begin, unsigned char* end, Image<T>* output, long firstPixel, long outputSize, long long maxGray){
+    AsciiParseError error = {AsciiParseError::ASCII_OK, 0};
+    long parsed = 0;
+    int i = firstPixel / output->jMax;
+    int j = firstPixel % output->jMax;
+    T* row = rowAt(output, i);
+    unsigned char* c = begin;
+    while(parsed < outputSize){
+        while(c < end && isPgmSpace(*c)) c++;
+        if(c >= end) break;
+        if(*c == '-'){
+            error.kind = AsciiParseError::ASCII_NEGATIVE;
+            return error;
+        }
+        if(*c < '0' || *c > '9'){
+            error.kind = AsciiParseError::ASCII_INVALID;
+            error.value = *c;
+            return error;
+        }
+        long long number = 0;
+        while(c < end && *c >= '0' && *c <= '9'){
+            // Satura em LLONG_MAX como o fscanf faz; nesse caso maxGray também saturou
+            number = number > (LLONG_MAX - 9) / 10 ? LLONG_MAX : number * 10 + (*c - '0');
+            c++;
+        }
+        if(number > maxGray){
+            error.kind = AsciiParseError::ASCII_ABOVE_MAX;
+            error.value = number;
+            return error;
+        }
+        row[j++] = (T) number;
+        parsed++;
+        if(j == output->jMax){
+            j = 0;
+            row += output->stride;
+        }
+    }
+    return error;
+}
+
+template <typename T>
+Image<T>* readAsciiImage(MappedPgm* pgm){
+    if (debugVerbose) printf("%d %d %lld ", pgm->jMax, pgm->iMax, pgm->maxGray);
+
+    Image<T>* image = allocateImage<T>(pgm->iMax, pgm->jMax);
+    long pixelCount = (long) pgm->iMax * pgm->jMax;
+    unsigned char* bodyBegin = MIN(pgm->pixels, pgm->data + pgm->size);
+    unsigned char* bodyEnd = pgm->data + pgm->size;
+    size_t bodySize = bodyEnd - bodyBegin;
+
+    // Pedaços muito pequenos não compensam a criação de threads
+    int chunkCount = MIN(getThreadCount(), (int) (bodySize / (1 << 16)) + 1);
+    unsigned char** chunkBegin = (unsigned char**) mallocLogging(sizeof(unsigned char*) * (chunkCount + 1));
+    long* chunkOffset = (long*) mallocLogging(sizeof(long) * (chunkCount + 1));
+    chunkBegin[0] = bodyBegin;
+    chunkBegin[chunkCount] = bodyEnd;
+    for(int k = 1; k < chunkCount; k++){
+        unsigned char* c = MIN(bodyBegin + bodySize * k / chunkCount, bodyEnd);
+        if(c < chunkBegin[k-1]) c = chunkBegin[k-1];
+        while(c < bodyEnd && !isPgmSpace(*c)) c++;
+        chunkBegin[k] = c;
+    }
+
+    runInParallel(chunkCount, [&](int k){
+        chunkOffset[k + 1] = countAsciiTokens(chunkBegin[k], chunkBegin[k + 1]);
+    });
+    chunkOffset[0] = 0;
+    for(int k = 0; k < chunkCount; k++){
+        chunkOffset[k + 1] += chunkOffset[k];
+    }
+    AsciiParseError* errors = (AsciiParseError*) mallocLogging(sizeof(AsciiParseError) * chunkCount);
+    for(int k = 0; k < chunkCount; k++) errors[k].kind = AsciiParseError::ASCII_OK;
+    if(chunkOffset[chunkCount] < pixelCount){
+        failRead("PGM has %ld pixels but its header says %ld.", chunkOffset[chunkCount], pixelCount);
+        freeImage(image);
+        image = NULL;
+    } else {
+        runInParallel(chunkCount, [&](int k){
+            if(chunkOffset[k] >= pixelCount) return;
+            long outputSize = MIN(chunkOffset[k + 1], pixelCount) - chunkOffset[k];
+            errors[k] = parseAsciiTokens(chunkBegin[k], chunkBegin[k + 1], image, chunkOffset[k], outputSize, pgm->maxGray);
+        });
+    }
+
+    // O primeiro pedaço com erro é o primeiro erro do arquivo
+    for(int k = 0; k < chunkCount && image; k++){
+        if(errors[k].kind == AsciiParseError::ASCII_OK) continue;
+        if(errors[k].kind == AsciiParseError::ASCII_NEGATIVE){
+            failRead("number from PGM is lower than zero. Maybe PGM file max gray scale is greater than long long?");
+        } else if(errors[k].kind == AsciiParseError::ASCII_INVALID){
+            failRead("Invalid character '%c' in PGM body.", (char) errors[k].value);
+        } else {
+            failRead("Pixel %lld is greater than PGM max gray %lld.", errors[k].value, pgm->maxGray);
+        }
+        freeImage(image);
+        image = NULL;
+    }
+    freeLogging(errors);
+    freeLogging(chunkBegin);
+    freeLogging(chunkOffset);
+    return image;
+}
+
+/*
+ * Escolhe o menor tipo de pixel capaz de representar maxGray. Um maxGray saturado
+ * em LLONG_MAX (readPgmHeaderNumber) não representa mais os pixels e é rejeitado.
+ */
+SourceImage* readAsciiSourceImage(MappedPgm* pgm){
+    SourceImage* source = NULL;
+    if(pgm->maxGray == LLONG_MAX){
+        failRead("PGM max gray is greater than long long.");
+        unmapPgm(pgm);
+        return NULL;
+    }
+    if(pgm->maxGray <= UINT8_MAX){
+        Image<uint8_t>* image = readAsciiImage<uint8_t>(pgm);
+        if(image) source = createSourceImage(PIXEL_UINT8, image, pgm->maxGray);
+    } else if(pgm->maxGray <= UINT16_MAX){
+        Image<uint16_t>* image = readAsciiImage<uint16_t>(pgm);
+        if(image) source = createSourceImage(PIXEL_UINT16, image, pgm->maxGray);
+    } else if(pgm->maxGray <= UINT32_MAX){
+        Image<uint32_t>* image = readAsciiImage<uint32_t>(pgm);
+        if(image) source = createSourceImage(PIXEL_UINT32, image, pgm->maxGray);
+    } else {
+        Image<long long>* image = readAsciiImage<long long>(pgm);
+        if(image) source = createSourceImage(PIXEL_INT64, image, pgm->maxGray);
+    }
+    unmapPgm(pgm);
+    return source;
+}
+
+SourceImage* readImage(char* filename){
+    if(debugVerbose) printf("Reading %s\n", filename);
+
+    MappedPgm* pgm = mapPgm(filename);
+    if(!pgm) return NULL;
+    if(strcmp(pgm->version, "P5") == 0){
+        return readBinaryImage(pgm);
+    } else if(strcmp(pgm->version, "P2") == 0){
+        return readAsciiSourceImage(pgm);
+    }
+    failRead("Unsupported PGM version %s. Use P2 or P5.", pgm->version);
+    unmapPgm(pgm);
+    return NULL;
+}
+
 /* 
  * Função muito simples para checagem da maioria dos overflows 
- * para exibir uma mensagem mais amigável. 
+ * para exibir uma mensagem mais amigável. Usada somente pela geração original
+ * (generateIntegralImage); os demais caminhos usam a análise de withIntegralType.
  */
 void checkOverflow(long long greater, long long lower){
     if (lower > greater){
@@ -132,218 +972,2420 @@ double pow(double base, int exponent){
 /*
  * Função para geração de imagem integral genérica para qualquer expoente
  */
-Image* generateIntegralImage(Image* source, int powExponent){
-    Image* integralImage = allocateImage(source->iMax, source->jMax);
+template <typename T>
+Image<typename IntegralType<T>::type>* generateIntegralImage(Image<T>* source, int powExponent){
+    typedef typename IntegralType<T>::type A;
+    Image<A>* integralImage = allocateImage<A>(source->iMax, source->jMax);
 
     for(int i = 0; i < source->iMax;i++){
+        T* sourceRow = rowAt(source, i);
+        A* row = rowAt(integralImage, i);
+        A* previousRow = i==0 ? NULL : rowAt(integralImage, i-1);
         for(int j = 0; j < source->jMax;j++){
-            long long original = pow(source->matrix[i][j], powExponent);
+            A original = pow(sourceRow[j], powExponent);
             // Validação de i e j para quando está nas bordas superiores e esquerda
-            long long upper = j==0 ? 0 : integralImage->matrix[i][j-1];
-            long long left = i==0 ? 0 : integralImage->matrix[i-1][j];
-            long long intersected = i==0 || j==0 ? 0 : integralImage->matrix[i-1][j-1];
-            long long result = original - intersected + upper + left;
+            A upper = j==0 ? 0 : row[j-1];
+            A left = i==0 ? 0 : previousRow[j];
+            A intersected = i==0 || j==0 ? 0 : previousRow[j-1];
+            A result = original - intersected + upper + left;
 
-            integralImage->matrix[i][j] = result;
-            checkOverflow(integralImage->matrix[i][j], 0); 
+            row[j] = result;
+            checkOverflow(row[j], 0); 
         }    
     }
 
     return integralImage;
 }
 
+/* ------------------------------------------ OVERFLOW UTILS ------------------------------------------
+ * Análise de overflow feita uma única vez, a partir do cabeçalho, antes de qualquer
+ * processamento. A maior célula de uma imagem integral é a última do maior momento,
+ * limitada por maxGray^moments * iMax * jMax, e toda soma de janela e toda conta
+ * C - B - D + A ficam entre -limite e +limite. Com esse limite escolhemos o menor
+ * acumulador inteiro que o comporta, e os laços de geração e varredura não precisam
+ * de nenhuma conferência por pixel.
+ *
+ * Com acumuladores sem sinal a tabela pode até "dar a volta" (aritmética módulo 2^k):
+ * C - B - D + A calculado módulo 2^k continua exato sempre que a soma da própria
+ * janela é menor que 2^k, não importa o tamanho da imagem. A soma de uma janela t x t
+ * é limitada por maxGray^moments * t², então para imagens de 8 bits com janelas de
+ * até 257 x 257 as duas somas (x e x²) cabem em uint32_t, com metade da memória das
+ * tabelas de long long.
+ */
+typedef unsigned __int128 IntegralBound;
 
-// ------------------------------------------ VARIANCE UTILS ------------------------------------------
-typedef struct {
-    int iLowestVar;
-    int jLowestVar;
-    double lowestVariance;
-    long tSize;
-    double windowAverage;
-}VarianceResult;
+IntegralBound saturatingMultiply(IntegralBound a, IntegralBound b){
+    IntegralBound max = ~(IntegralBound) 0;
+    if(a != 0 && b > max / a) return max;
+    return a * b;
+}
+
+IntegralBound getIntegralBound(long long maxGray, int iMax, int jMax, int moments){
+    IntegralBound bound = 1;
+    for(int m = 0; m < moments; m++){
+        bound = saturatingMultiply(bound, maxGray);
+    }
+    bound = saturatingMultiply(bound, iMax);
+    return saturatingMultiply(bound, jMax);
+}
+
+/*
+ * Chama function com um ponteiro nulo do acumulador escolhido, (uint32_t*) NULL por
+ * exemplo, no mesmo estilo de withSourceImage. A ordem de preferência é uint32_t
+ * módulo 2^32, long long sem volta (que tem as versões AVX2), e só então os módulos
+ * 2^64 e 2^128. As janelas não podem passar de maxTSize x getWindowWidth(maxTSize);
+ * imagens cujas janelas não cabem nem em 128 bits são rejeitadas aqui. A escolha só
+ * depende das dimensões, então também pode ser feita antes de ler a imagem.
+ *
+ * Os limites supõem que nenhum pixel passa de maxGray: com as tabelas módulo 2^32 um
+ * pixel acima dele dá voltas sem aviso. Por isso toda leitura rejeita esses pixels
+ * (parseAsciiTokens, checkBinaryPixels e readPgmStreamRow) antes de chegar aqui.
+ */
+IntegralBound getWindowIntegralBound(int iMax, int jMax, long long maxGray, int moments, long maxTSize){
+    long windowHeight = MIN(maxTSize, (long) iMax);
+    long windowSide = MIN(getWindowWidth(maxTSize), (long) jMax);
+    // Uma janela quadrada só cabe se couber nas duas dimensões
+    if(windowWidth == 0) windowHeight = windowSide = MIN(windowHeight, windowSide);
+    if(windowHeight < 1) windowHeight = 1;
+    if(windowSide < 1) windowSide = 1;
+    return getIntegralBound(maxGray, windowHeight, windowSide, moments);
+}
+
+/*
+ * Se withIntegralType tem um acumulador para a imagem, sem terminar o programa.
+ */
+bool fitsIntegralImages(int iMax, int jMax, long long maxGray, int moments, long maxTSize){
+    return getWindowIntegralBound(iMax, jMax, maxGray, moments, maxTSize) < ~(IntegralBound) 0;
+}
+
+template <typename Function>
+void withIntegralType(int iMax, int jMax, long long maxGray, int moments, long maxTSize, Function function){
+    IntegralBound windowBound = getWindowIntegralBound(iMax, jMax, maxGray, moments, maxTSize);
+    IntegralBound bound = getIntegralBound(maxGray, iMax, jMax, moments);
+    if(windowBound <= UINT32_MAX){
+        function((uint32_t*) NULL);
+    } else if(bound <= LLONG_MAX){
+        function((long long*) NULL);
+    } else if(windowBound <= ULLONG_MAX){
+        function((unsigned long long*) NULL);
+    } else if(windowBound < ~(IntegralBound) 0){
+        function((unsigned __int128*) NULL);
+    } else {
+        printf("Error: Image %d x %d with max gray %lld overflows the integral images.\n", iMax, jMax, maxGray);
+        exit(1);
+    }
+}
+
+template <typename T, typename Function>
+void withIntegralType(Image<T>* source, long long maxGray, int moments, long maxTSize, Function function){
+    withIntegralType(source->iMax, source->jMax, maxGray, moments, maxTSize, function);
+}
+
+template <typename Function>
+void withIntegralType(Image<double>* source, long long maxGray, int moments, long maxTSize, Function function){
+    function((double*) NULL);
+}
+
+/*
+ * Imagem integral com borda: a tabela tem uma linha e uma coluna a mais, ambas zeradas,
+ * e a posição (i, j) guarda a soma dos pixels das linhas 0..i-1 e colunas 0..j-1 da
+ * imagem de origem. Assim a soma de qualquer janela t x t com canto em (i, j) é
+ * sempre C - B - D + A, com A = (i, j), B = (i, j+t), C = (i+t, j+t) e D = (i+t, j),
+ * sem nenhum teste de borda.
+ *
+ * Cada posição guarda "moments" somas intercaladas: a soma de x, de x², e
+ * opcionalmente de x³ e x⁴. Os momentos de um mesmo canto ficam lado a lado, então
+ * os quatro cantos de todos os momentos caem nas mesmas linhas de cache.
+ */
+#define MAX_MOMENTS 4
+
+template <typename A>
+struct IntegralImage {
+    A* array;
+    long stride;
+    int iMax; // dimensões da imagem de origem, a tabela tem iMax+1 x jMax+1
+    int jMax;
+    int moments;
+    void* mapping; // arquivo do cache quando a tabela foi mapeada dele, NULL quando alocada
+    size_t mappedBytes;
+};
+
+template <typename A>
+inline A* integralRowAt(IntegralImage<A>* integral, int i){
+    return integral->array + i * integral->stride;
+}
+
+/*
+ * Primeiro momento do canto (i, j) de uma linha; os demais vêm em seguida.
+ */
+template <typename A>
+inline A* integralCell(IntegralImage<A>* integral, A* row, int j){
+    return row + j * integral->moments;
+}
+
+template <typename A>
+IntegralImage<A>* allocateIntegralImage(int iMax, int jMax, int moments){
+    long rowBytes = sizeof(A) * (jMax + 1) * moments;
+    rowBytes = (rowBytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+
+    IntegralImage<A>* integral = (IntegralImage<A>*) mallocLogging(sizeof(IntegralImage<A>));
+    integral->array = (A*) mallocAlignedLogging(IMAGE_ALIGNMENT, rowBytes * (iMax + 1));
+    integral->stride = rowBytes / sizeof(A);
+    integral->iMax = iMax;
+    integral->jMax = jMax;
+    integral->moments = moments;
+    integral->mapping = NULL;
+    integral->mappedBytes = 0;
+    memset(integral->array, 0, rowBytes);
+    return integral;
+}
+
+template <typename A>
+void freeIntegralImage(IntegralImage<A>* integral){
+    if(integral->mapping) munmap(integral->mapping, integral->mappedBytes);
+    else freeLogging(integral->array);
+    freeLogging(integral);
+}
+
+/*
+ * Soma de prefixos vetorizada (AVX2) de uma linha da imagem integral de 2 momentos,
+ * somando a linha de cima quando addUpper (a versão paralela soma as linhas de cima
+ * depois, em faixas de colunas). Cada vetor de 4 long long guarda 2 células [x, x²]
+ * consecutivas; o prefixo dentro do vetor é feito deslocando uma célula (128 bits) e
+ * somando, e o acumulado das células anteriores vem em "carry", que é a última célula
+ * do vetor anterior repetida nas duas metades. As tabelas módulo 2^32 têm a sua
+ * própria versão, com 4 células por vetor.
+ */
+template <typename T, typename A>
+bool canBuildRowsWithAvx2(Image<T>* source, IntegralImage<A>* integral){
+    return false;
+}
+
+template <typename T>
+bool canBuildRowsWithAvx2(Image<T>* source, IntegralImage<long long>* integral){
+    return std::is_integral<T>::value && sizeof(T) <= 2 && simdEnabled && hasAvx2() && integral->moments == 2;
+}
+
+template <typename T>
+bool canBuildRowsWithAvx2(Image<T>* source, IntegralImage<uint32_t>* integral){
+    return std::is_integral<T>::value && sizeof(T) <= 2 && simdEnabled && hasAvx2() && integral->moments == 2;
+}
+
+template <bool addUpper, typename T, typename A>
+void buildIntegralRowAvx2(T* sourceRow, int jMax, A* upper, A* row){
+}
+
+template <bool addUpper, typename T>
+__attribute__((target("avx2")))
+void buildIntegralRowAvx2(T* sourceRow, int jMax, long long* upper, long long* row){
+    // A célula 0 é a borda, os pixels começam na célula 1
+    long long* output = row + 2;
+    long long* above = upper + 2;
+    row[0] = 0;
+    row[1] = 0;
+
+    __m256i carry = _mm256_setzero_si256();
+    int j = 0;
+    for(; j + 4 <= jMax; j += 4){
+        long long x0 = sourceRow[j], x1 = sourceRow[j + 1], x2 = sourceRow[j + 2], x3 = sourceRow[j + 3];
+        __m256i low = _mm256_setr_epi64x(x0, x0 * x0, x1, x1 * x1);
+        __m256i high = _mm256_setr_epi64x(x2, x2 * x2, x3, x3 * x3);
+        // [a, b] + [0, a] = [a, a + b]
+        low = _mm256_add_epi64(low, _mm256_permute2x128_si256(low, low, 0x08));
+        high = _mm256_add_epi64(high, _mm256_permute2x128_si256(high, high, 0x08));
+        low = _mm256_add_epi64(low, carry);
+        high = _mm256_add_epi64(high, _mm256_permute4x64_epi64(low, 0xEE));
+        carry = _mm256_permute4x64_epi64(high, 0xEE);
+
+        if(addUpper){
+            low = _mm256_add_epi64(low, _mm256_loadu_si256((__m256i*) (above + 2*j)));
+            high = _mm256_add_epi64(high, _mm256_loadu_si256((__m256i*) (above + 2*j + 4)));
+        }
+        _mm256_storeu_si256((__m256i*) (output + 2*j), low);
+        _mm256_storeu_si256((__m256i*) (output + 2*j + 4), high);
+    }
+
+    long long rowSum[2];
+    _mm_storeu_si128((__m128i*) rowSum, _mm256_castsi256_si128(carry));
+    for(; j < jMax; j++){
+        long long pixel = sourceRow[j];
+        rowSum[0] += pixel;
+        rowSum[1] += pixel * pixel;
+        output[2*j] = (addUpper ? above[2*j] : 0) + rowSum[0];
+        output[2*j + 1] = (addUpper ? above[2*j + 1] : 0) + rowSum[1];
+    }
+}
+
+/*
+ * Mesma soma para as tabelas módulo 2^32: um vetor de 8 uint32 guarda 4 células. O
+ * prefixo soma a célula anterior dentro de cada metade (deslocamento de 64 bits) e
+ * depois a última célula da metade de baixo na metade de cima. Todas as contas são
+ * módulo 2^32, como na versão escalar.
+ */
+template <bool addUpper, typename T>
+__attribute__((target("avx2")))
+void buildIntegralRowAvx2(T* sourceRow, int jMax, uint32_t* upper, uint32_t* row){
+    uint32_t* output = row + 2;
+    uint32_t* above = upper + 2;
+    row[0] = 0;
+    row[1] = 0;
+
+    __m256i lastCell = _mm256_setr_epi32(6, 7, 6, 7, 6, 7, 6, 7);
+    __m256i carry = _mm256_setzero_si256();
+    int j = 0;
+    for(; j + 4 <= jMax; j += 4){
+        uint32_t x0 = sourceRow[j], x1 = sourceRow[j + 1], x2 = sourceRow[j + 2], x3 = sourceRow[j + 3];
+        __m256i cells = _mm256_setr_epi32(x0, x0 * x0, x1, x1 * x1, x2, x2 * x2, x3, x3 * x3);
+        // [a, b | c, d] + [0, a | 0, c] = [a, a + b | c, c + d]
+        cells = _mm256_add_epi32(cells, _mm256_slli_si256(cells, 8));
+        // + [0, 0 | a + b, a + b]
+        __m256i lowLast = _mm256_shuffle_epi32(cells, 0xEE);
+        cells = _mm256_add_epi32(cells, _mm256_permute2x128_si256(lowLast, lowLast, 0x08));
+        cells = _mm256_add_epi32(cells, carry);
+        carry = _mm256_permutevar8x32_epi32(cells, lastCell);
+
+        if(addUpper) cells = _mm256_add_epi32(cells, _mm256_loadu_si256((__m256i*) (above + 2*j)));
+        _mm256_storeu_si256((__m256i*) (output + 2*j), cells);
+    }
+
+    uint32_t rowSum[4];
+    _mm_storeu_si128((__m128i*) rowSum, _mm256_castsi256_si128(carry));
+    for(; j < jMax; j++){
+        uint32_t pixel = sourceRow[j];
+        rowSum[0] += pixel;
+        rowSum[1] += pixel * pixel;
+        output[2*j] = (addUpper ? above[2*j] : 0) + rowSum[0];
+        output[2*j + 1] = (addUpper ? above[2*j + 1] : 0) + rowSum[1];
+    }
+}
+
+/*
+ * Versão paralela da geração em duas passadas. Na primeira, faixas de linhas são
+ * processadas em paralelo e cada linha recebe somente o acumulado da própria linha
+ * da imagem de origem. Na segunda, faixas de colunas (múltiplas de 64 bytes, para
+ * que duas threads nunca escrevam na mesma linha de cache) descem a tabela somando
+ * a linha de cima. As somas são as mesmas da versão sequencial, então o resultado
+ * é idêntico. A primeira passada usa a soma de prefixos AVX2 quando disponível.
+ */
+#define PARALLEL_INTEGRAL_MIN_PIXELS (256 * 256)
+
+template <typename T, typename A>
+void generateMomentsIntegralImageInParallel(Image<T>* source, IntegralImage<A>* integral){
+    int moments = integral->moments;
+    bool vectorized = canBuildRowsWithAvx2(source, integral);
+    int bandCount = MIN(getThreadCount() * SCAN_BANDS_PER_THREAD, source->iMax);
+    runInParallel(bandCount, [&](int band){
+        int iBegin = (long) source->iMax * band / bandCount;
+        int iEnd = (long) source->iMax * (band + 1) / bandCount;
+        A rowSum[MAX_MOMENTS];
+        for(int i = iBegin; i < iEnd; i++){
+            T* sourceRow = rowAt(source, i);
+            A* row = integralRowAt(integral, i + 1);
+            if(vectorized){
+                buildIntegralRowAvx2<false>(sourceRow, source->jMax, (A*) NULL, row);
+                continue;
+            }
+            for(int m = 0; m < moments; m++){
+                rowSum[m] = 0;
+                row[m] = 0;
+            }
+            for(int j = 0; j < source->jMax; j++){
+                A pixel = sourceRow[j];
+                A power = pixel;
+                A* cell = integralCell(integral, row, j + 1);
+                for(int m = 0; m < moments; m++){
+                    rowSum[m] += power;
+                    cell[m] = rowSum[m];
+                    power *= pixel;
+                }
+            }
+        }
+    });
+
+    long rowElements = (long) (source->jMax + 1) * moments;
+    long stripAlignment = IMAGE_ALIGNMENT / sizeof(A) > 0 ? IMAGE_ALIGNMENT / sizeof(A) : 1;
+    long stripElements = (rowElements + getThreadCount() * SCAN_BANDS_PER_THREAD - 1) / (getThreadCount() * SCAN_BANDS_PER_THREAD);
+    stripElements = (stripElements + stripAlignment - 1) / stripAlignment * stripAlignment;
+    int stripCount = (rowElements + stripElements - 1) / stripElements;
+    runInParallel(stripCount, [&](int strip){
+        long eBegin = strip * stripElements;
+        long eEnd = MIN(eBegin + stripElements, rowElements);
+        for(int i = 1; i < source->iMax; i++){
+            A* upper = integralRowAt(integral, i);
+            A* row = integralRowAt(integral, i + 1);
+            for(long e = eBegin; e < eEnd; e++){
+                row[e] += upper[e];
+            }
+        }
+    });
+}
+
+/*
+ * Gera todos os momentos da imagem integral com borda em uma única passada pela
+ * imagem de origem. Cada linha é a linha de cima somada ao acumulado da linha atual,
+ * e as potências de cada pixel saem de multiplicações sucessivas. Com mais de uma
+ * thread e imagens não muito pequenas é usada a versão paralela em duas passadas.
+ * O acumulador A já deve ter sido escolhido com withIntegralType, então não há
+ * nenhuma conferência de overflow aqui.
+ */
+template <typename T, typename A>
+void buildMomentsIntegralImage(Image<T>* source, IntegralImage<A>* integral){
+    int moments = integral->moments;
+    if(getThreadCount() > 1 && (long) source->iMax * source->jMax >= PARALLEL_INTEGRAL_MIN_PIXELS){
+        generateMomentsIntegralImageInParallel(source, integral);
+        return;
+    }
+
+    bool vectorized = canBuildRowsWithAvx2(source, integral);
+    A rowSum[MAX_MOMENTS];
+    for(int i = 0; i < source->iMax; i++){
+        T* sourceRow = rowAt(source, i);
+        A* upper = integralRowAt(integral, i);
+        A* row = integralRowAt(integral, i + 1);
+        if(vectorized){
+            buildIntegralRowAvx2<true>(sourceRow, source->jMax, upper, row);
+            continue;
+        }
+        for(int m = 0; m < moments; m++){
+            rowSum[m] = 0;
+            row[m] = 0;
+        }
+        for(int j = 0; j < source->jMax; j++){
+            A pixel = sourceRow[j];
+            A power = pixel;
+            A* cell = integralCell(integral, row, j + 1);
+            A* upperCell = integralCell(integral, upper, j + 1);
+            for(int m = 0; m < moments; m++){
+                rowSum[m] += power;
+                cell[m] = upperCell[m] + rowSum[m];
+                power *= pixel;
+            }
+        }
+    }
+}
+
+template <typename A, typename T>
+IntegralImage<A>* generateMomentsIntegralImageAs(Image<T>* source, int moments){
+    if(moments < 1 || moments > MAX_MOMENTS){
+        printf("Error: Integral images support 1 to %d moments.\n", MAX_MOMENTS);
+        exit(1);
+    }
+    IntegralImage<A>* integral = allocateIntegralImage<A>(source->iMax, source->jMax, moments);
+    buildMomentsIntegralImage(source, integral);
+    return integral;
+}
+
+/*
+ * Versão com o acumulador padrão do tipo de pixel (IntegralType), para quem já sabe
+ * que a imagem cabe nele, como os benchmarks com imagens sintéticas.
+ */
+template <typename T>
+IntegralImage<typename IntegralType<T>::type>* generateMomentsIntegralImage(Image<T>* source, int moments){
+    return generateMomentsIntegralImageAs<typename IntegralType<T>::type>(source, moments);
+}
+
+template <typename A>
+void printIntegralImage(IntegralImage<A>* integral){
+    printf("Size: %d x %d x %d\n", integral->iMax + 1, integral->jMax + 1, integral->moments);
+    for (int i = 0; i <= integral->iMax; i++){
+        printf("%d: [", i);
+        for (int j = 0; j <= integral->jMax; j++){
+            A* cell = integralCell(integral, integralRowAt(integral, i), j);
+            for (int m = 0; m < integral->moments; m++){
+                printPixel(cell[m]);
+            }
+            printf("|");
+        }
+        printf("]\n");
+    }
+}
+
+// ------------------------------------------ VARIANCE UTILS ------------------------------------------
+typedef struct {
+    int iLowestVar;
+    int jLowestVar;
+    double lowestVariance;
+    long tSize;
+    double windowAverage;
+    __int128 scaledVariance; // n² * variância exata no modo --exact, -1 fora dele
+}VarianceResult;
+
+/*
+ * Como primeira abordagem, utilizou-se a fórmula (2) da variância no enunciado, 
+ * implementado pela função a seguir deste programa. Isto pois, segundo
+ * a fórmula, precisamos primeiro calcular a média da janela para finalmente calcularmos a
+ * variância, necessitando percorrer duas vezes o mesmo conjunto de elementos dentro da 
+ * janela.
+ */
+
+template <typename T>
+VarianceResult* getVarianceAccessingTwice(Image<T> *source, long tSize){
+    double lowestVariance = 9999999999999; // um valor bem grande
+    int iLowestVariance = -1, jLowestVariance = -1;
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    double windowSum, windowAvg, sumToVar, variance, windowAverage = 0;
+
+    for(int i = 0; i < source->iMax - (tSize -1); i += iStride){
+        for(int j = 0; j < source->jMax - (tWidth -1); j += jStride){
+            // Calculate Average
+            windowSum = 0;
+            for(int iWindow = i; iWindow < i + tSize; iWindow++){
+                T* row = rowAt(source, iWindow);
+                for(int jWindow = j; jWindow < j + tWidth; jWindow++){
+                    windowSum += row[jWindow];
+                }
+            }
+            windowAvg = windowSum / windowSize;
+            // Calculate Variance
+            sumToVar = 0;
+            for(int iWindow = i; iWindow < i + tSize; iWindow++){
+                T* row = rowAt(source, iWindow);
+                for(int jWindow = j; jWindow < j + tWidth; jWindow++){
+                    sumToVar += pow(row[jWindow] - windowAvg, 2);
+                }
+            }
+            variance = sumToVar / windowSize;
+            
+            if(variance < lowestVariance){
+                lowestVariance = variance;
+                windowAverage = windowAvg;
+                iLowestVariance = i;
+                jLowestVariance = j;
+            }
+        }
+    }
+
+    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
+    
+    varianceResult->windowAverage = windowAverage;
+    varianceResult->iLowestVar = iLowestVariance;
+    varianceResult->jLowestVar = jLowestVariance;
+    varianceResult->lowestVariance = lowestVariance; 
+    varianceResult->tSize = tSize;
+    varianceResult->scaledVariance = -1;
+    
+    return varianceResult;
+}
+
+/* 
+ * Já na segunda abordagem, utilizando a fórmula (4) do enunciado, conseguimos em uma única 
+ * visita à todos os itens da janela calcular a variância.
+ */
+template <typename T>
+VarianceResult* getVarianceAccessingOnce(Image<T> *source, long tSize){
+    double lowestVariance = 9999999999999; //long long highest value
+    int iLowestVariance = -1, jLowestVariance = -1;
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+
+    double windowSum, sumToVar, windowAvg, variance, windowAverage = 0; 
+    for(int i = 0; i < source->iMax - (tSize -1); i += iStride){
+        for(int j = 0; j < source->jMax - (tWidth -1); j += jStride){
+            // Accumulate  
+            windowSum = 0;
+            sumToVar = 0;
+            for(int iWindow = i; iWindow < i + tSize; iWindow++){
+                T* row = rowAt(source, iWindow);
+                for(int jWindow = j; jWindow < j + tWidth; jWindow++){
+                    sumToVar += pow(row[jWindow], 2);
+                    windowSum += row[jWindow];
+                }
+            }
+            // Calculate Average
+            windowAvg = windowSum / windowSize;
+            // Calculate Variance
+            variance = (sumToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
+            
+            if(variance < lowestVariance){
+                lowestVariance = variance;
+                windowAverage = windowAvg;
+                iLowestVariance = i;
+                jLowestVariance = j;
+            }
+        }
+    }
+
+    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
+    
+    varianceResult->windowAverage = windowAverage;
+    varianceResult->iLowestVar = iLowestVariance;
+    varianceResult->jLowestVar = jLowestVariance;
+    varianceResult->lowestVariance = lowestVariance; 
+    varianceResult->tSize = tSize;
+    varianceResult->scaledVariance = -1;
+    
+    return varianceResult;
+}
+
+/* 
+ * E finalmente, como terceira abordagem utilizamos Imagens Integrais. Note que para que
+ * o cálculo da variância ser possível foi necessário gerar duas imagens integrais: 
+ * (1) a soma, que dado um ponto, continha a soma de todos os pixels à esquerda 
+ * e acima dele e (2) a soma dos quadrados, que contém lógica similar, porém calculando o 
+ * valor da imagem original ao quadrado. Assim, foi possível com somente 8 acessos (4 em 
+ * cada imagem integral) calcular a variância da janela na imagem original. As duas
+ * tabelas são geradas juntas e intercaladas em uma única IntegralImage de 2 momentos.
+ * As imagens integrais têm borda zerada, então esses 8 acessos não dependem de
+ * nenhum teste de borda e o laço interno não tem desvios. As somas da janela são
+ * feitas no próprio acumulador, que é exato (inclusive módulo 2^k nas tabelas sem
+ * sinal), e só então convertidas para double. Para janelas t x w os cantos B e C
+ * ficam w colunas à direita de A e D.
+ */
+template <typename A>
+inline void scanIntegralRow(IntegralImage<A>* integral, int i, long tSize, VarianceResult* varianceResult){
+    double lowestVariance = varianceResult->lowestVariance;
+    int iLowestVariance = varianceResult->iLowestVar, jLowestVariance = varianceResult->jLowestVar;
+    double windowAverage = varianceResult->windowAverage;
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+
+    A pow2ToVarA, pow2ToVarB, pow2ToVarC, pow2ToVarD, 
+        sumToAvgA, sumToAvgB, sumToAvgC, sumToAvgD;
+    double pow2ToVar, windowSum, windowAvg, variance;
+    int moments = integral->moments;
+    // Linhas acima (upper) e na base (lower) da janela
+    A* upper = integralRowAt(integral, i);
+    A* lower = integralRowAt(integral, i + tSize);
+    A* cellA = upper;
+    A* cellB = upper + tWidth * moments;
+    A* cellC = lower + tWidth * moments;
+    A* cellD = lower;
+    int step = moments * jStride;
+    for(int j = 0; j < integral->jMax - (tWidth -1); j += jStride){
+        pow2ToVarA = cellA[1];
+        pow2ToVarB = cellB[1];
+        pow2ToVarC = cellC[1];
+        pow2ToVarD = cellD[1];
+        pow2ToVar = (double) (pow2ToVarC - pow2ToVarB - pow2ToVarD + pow2ToVarA); 
+
+        sumToAvgA = cellA[0];
+        sumToAvgB = cellB[0];
+        sumToAvgC = cellC[0];
+        sumToAvgD = cellD[0];
+        windowSum = (double) (sumToAvgC - sumToAvgB - sumToAvgD + sumToAvgA);
+        windowAvg = windowSum / windowSize;
+            
+        variance = (pow2ToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
+
+        if(variance < lowestVariance){
+            lowestVariance = variance;
+            windowAverage = windowAvg;
+            iLowestVariance = i;
+            jLowestVariance = j;
+        }
+        cellA += step;
+        cellB += step;
+        cellC += step;
+        cellD += step;
+    }
+
+    varianceResult->windowAverage = windowAverage;
+    varianceResult->iLowestVar = iLowestVariance;
+    varianceResult->jLowestVar = jLowestVariance;
+    varianceResult->lowestVariance = lowestVariance; 
+}
+
+void initVarianceResult(VarianceResult* varianceResult, long tSize){
+    varianceResult->windowAverage = 0;
+    varianceResult->iLowestVar = -1;
+    varianceResult->jLowestVar = -1;
+    varianceResult->lowestVariance = 9999999999999; //long long highest value
+    varianceResult->tSize = tSize;
+    varianceResult->scaledVariance = -1;
+}
+
+/* 
+ * Versão AVX2 de scanIntegralRow, escolhida em tempo de execução (canScanWithAvx2) e
+ * usada somente para imagens integrais de long long com 2 momentos e jStride = 1.
+ * Avalia 4 janelas vizinhas por iteração: os cantos de 4 células intercaladas [s, q, s, q, ...] são
+ * carregados em dois vetores contíguos e separados com unpacklo/unpackhi, o que deixa
+ * as janelas na ordem j, j+2, j+1, j+3 nas 4 posições do vetor. Cada posição guarda o
+ * seu menor valor com um blend que também guarda a média e o j, e no fim da linha as
+ * posições são reduzidas pelo menor (variância, j). As contas são as mesmas da versão
+ * escalar, na mesma ordem, então o resultado é idêntico.
+ *
+ * O AVX2 não converte int64 para double; como todas as somas são positivas e menores
+ * que 2^52 (conferido em canScanWithAvx2), basta juntar os bits ao expoente de 2^52
+ * e subtrair 2^52, o que é exato.
+ */
+#define AVX2_EXACT_LIMIT (1LL << 52)
+
+template <typename A>
+bool canScanWithAvx2(IntegralImage<A>* integral){
+    return false;
+}
+
+bool canScanWithAvx2(IntegralImage<long long>* integral){
+    if(!simdEnabled || !hasAvx2() || integral->moments != 2) return false;
+    // A última célula tem as maiores somas de cada momento
+    long long* last = integralCell(integral, integralRowAt(integral, integral->iMax), integral->jMax);
+    return last[0] < AVX2_EXACT_LIMIT && last[1] < AVX2_EXACT_LIMIT;
+}
+
+template <typename A>
+void scanIntegralRowAvx2(IntegralImage<A>* integral, int i, long tSize, VarianceResult* varianceResult){
+    scanIntegralRow(integral, i, tSize, varianceResult);
+}
+
+/*
+ * Junta as 4 pistas de um núcleo AVX2 no resultado da linha: menor variância e, no
+ * empate, o menor j, como a varredura escalar.
+ */
+__attribute__((target("avx2")))
+void reduceAvx2Lanes(__m256d bestVariance, __m256d bestAverage, __m256d bestJ, int i, VarianceResult* varianceResult){
+    double laneVariance[4], laneAverage[4], laneJ[4];
+    _mm256_storeu_pd(laneVariance, bestVariance);
+    _mm256_storeu_pd(laneAverage, bestAverage);
+    _mm256_storeu_pd(laneJ, bestJ);
+    int bestLane = -1;
+    for(int lane = 0; lane < 4; lane++){
+        if(laneJ[lane] < 0) continue;
+        if(bestLane < 0 || laneVariance[lane] < laneVariance[bestLane] ||
+            (laneVariance[lane] == laneVariance[bestLane] && laneJ[lane] < laneJ[bestLane])){
+            bestLane = lane;
+        }
+    }
+    if(bestLane >= 0){
+        varianceResult->lowestVariance = laneVariance[bestLane];
+        varianceResult->windowAverage = laneAverage[bestLane];
+        varianceResult->iLowestVar = i;
+        varianceResult->jLowestVar = (int) laneJ[bestLane];
+    }
+}
+
+/*
+ * Janelas que sobraram no fim da linha, a partir de jBegin, feitas uma a uma.
+ */
+template <typename A>
+void scanIntegralRowTail(IntegralImage<A>* integral, int i, long tSize, int jBegin, VarianceResult* varianceResult){
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    int jCount = integral->jMax - (tWidth -1);
+    A* cellA = integralRowAt(integral, i);
+    A* cellB = cellA + tWidth * 2;
+    A* cellD = integralRowAt(integral, i + tSize);
+    A* cellC = cellD + tWidth * 2;
+    double lowestVariance = varianceResult->lowestVariance;
+    for(int j = jBegin; j < jCount; j++){
+        double pow2ToVar = (double) (A) (cellC[2*j + 1] - cellB[2*j + 1] - cellD[2*j + 1] + cellA[2*j + 1]);
+        double windowSum = (double) (A) (cellC[2*j] - cellB[2*j] - cellD[2*j] + cellA[2*j]);
+        double windowAvg = windowSum / windowSize;
+        double variance = (pow2ToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
+        if(variance < lowestVariance){
+            lowestVariance = variance;
+            varianceResult->lowestVariance = variance;
+            varianceResult->windowAverage = windowAvg;
+            varianceResult->iLowestVar = i;
+            varianceResult->jLowestVar = j;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void scanIntegralRowAvx2(IntegralImage<long long>* integral, int i, long tSize, VarianceResult* varianceResult){
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    int jCount = integral->jMax - (tWidth -1);
+    long long* upper = integralRowAt(integral, i);
+    long long* lower = integralRowAt(integral, i + tSize);
+    long long* cellA = upper;
+    long long* cellB = upper + tWidth * 2;
+    long long* cellC = lower + tWidth * 2;
+    long long* cellD = lower;
+
+    const __m256i magicBits = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256d magic = _mm256_castsi256_pd(magicBits);
+    const __m256d windowSizeVector = _mm256_set1_pd(windowSize);
+    __m256d bestVariance = _mm256_set1_pd(varianceResult->lowestVariance);
+    __m256d bestAverage = _mm256_setzero_pd();
+    __m256d bestJ = _mm256_set1_pd(-1);
+    __m256d jLanes = _mm256_setr_pd(0, 2, 1, 3);
+    const __m256d four = _mm256_set1_pd(4);
+
+    int j = 0;
+    for(; j + 4 <= jCount; j += 4){
+        __m256i a0 = _mm256_loadu_si256((__m256i*) (cellA + 2*j));
+        __m256i a1 = _mm256_loadu_si256((__m256i*) (cellA + 2*j + 4));
+        __m256i b0 = _mm256_loadu_si256((__m256i*) (cellB + 2*j));
+        __m256i b1 = _mm256_loadu_si256((__m256i*) (cellB + 2*j + 4));
+        __m256i c0 = _mm256_loadu_si256((__m256i*) (cellC + 2*j));
+        __m256i c1 = _mm256_loadu_si256((__m256i*) (cellC + 2*j + 4));
+        __m256i d0 = _mm256_loadu_si256((__m256i*) (cellD + 2*j));
+        __m256i d1 = _mm256_loadu_si256((__m256i*) (cellD + 2*j + 4));
+
+        #define TO_DOUBLE(x) _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256((x), magicBits)), magic)
+        __m256d sumA = TO_DOUBLE(_mm256_unpacklo_epi64(a0, a1));
+        __m256d sumB = TO_DOUBLE(_mm256_unpacklo_epi64(b0, b1));
+        __m256d sumC = TO_DOUBLE(_mm256_unpacklo_epi64(c0, c1));
+        __m256d sumD = TO_DOUBLE(_mm256_unpacklo_epi64(d0, d1));
+        __m256d pow2A = TO_DOUBLE(_mm256_unpackhi_epi64(a0, a1));
+        __m256d pow2B = TO_DOUBLE(_mm256_unpackhi_epi64(b0, b1));
+        __m256d pow2C = TO_DOUBLE(_mm256_unpackhi_epi64(c0, c1));
+        __m256d pow2D = TO_DOUBLE(_mm256_unpackhi_epi64(d0, d1));
+        #undef TO_DOUBLE
+
+        __m256d pow2ToVar = _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(pow2C, pow2B), pow2D), pow2A);
+        __m256d windowSum = _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(sumC, sumB), sumD), sumA);
+        __m256d windowAvg = _mm256_div_pd(windowSum, windowSizeVector);
+        __m256d variance = _mm256_div_pd(
+            _mm256_sub_pd(pow2ToVar, _mm256_mul_pd(windowSizeVector, _mm256_mul_pd(windowAvg, windowAvg))),
+            windowSizeVector);
+
+        __m256d better = _mm256_cmp_pd(variance, bestVariance, _CMP_LT_OQ);
+        bestVariance = _mm256_blendv_pd(bestVariance, variance, better);
+        bestAverage = _mm256_blendv_pd(bestAverage, windowAvg, better);
+        bestJ = _mm256_blendv_pd(bestJ, jLanes, better);
+        jLanes = _mm256_add_pd(jLanes, four);
+    }
+
+    reduceAvx2Lanes(bestVariance, bestAverage, bestJ, i, varianceResult);
+    scanIntegralRowTail(integral, i, tSize, j, varianceResult);
+}
+
+/*
+ * Versão para as tabelas módulo 2^32 (uint32_t): um vetor de 8 uint32 tem 4 células
+ * [x, x²] inteiras, então C - B - D + A de 4 janelas sai em uma única conta de 32 bits,
+ * que é exata módulo 2^32. As somas e as somas dos quadrados são então separadas com
+ * uma permutação, estendidas para 64 bits e convertidas para double pelo mesmo truque
+ * de 2^52. Aqui as pistas já ficam na ordem j, j+1, j+2, j+3.
+ */
+bool canScanWithAvx2(IntegralImage<uint32_t>* integral){
+    return simdEnabled && hasAvx2() && integral->moments == 2;
+}
+
+__attribute__((target("avx2")))
+void scanIntegralRowAvx2(IntegralImage<uint32_t>* integral, int i, long tSize, VarianceResult* varianceResult){
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    int jCount = integral->jMax - (tWidth -1);
+    uint32_t* upper = integralRowAt(integral, i);
+    uint32_t* lower = integralRowAt(integral, i + tSize);
+    uint32_t* cellA = upper;
+    uint32_t* cellB = upper + tWidth * 2;
+    uint32_t* cellC = lower + tWidth * 2;
+    uint32_t* cellD = lower;
+
+    const __m256i magicBits = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256d magic = _mm256_castsi256_pd(magicBits);
+    const __m256i separate = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256d windowSizeVector = _mm256_set1_pd(windowSize);
+    __m256d bestVariance = _mm256_set1_pd(varianceResult->lowestVariance);
+    __m256d bestAverage = _mm256_setzero_pd();
+    __m256d bestJ = _mm256_set1_pd(-1);
+    __m256d jLanes = _mm256_setr_pd(0, 1, 2, 3);
+    const __m256d four = _mm256_set1_pd(4);
+
+    int j = 0;
+    for(; j + 4 <= jCount; j += 4){
+        __m256i a = _mm256_loadu_si256((__m256i*) (cellA + 2*j));
+        __m256i b = _mm256_loadu_si256((__m256i*) (cellB + 2*j));
+        __m256i c = _mm256_loadu_si256((__m256i*) (cellC + 2*j));
+        __m256i d = _mm256_loadu_si256((__m256i*) (cellD + 2*j));
+        __m256i window = _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(c, b), d), a);
+        // [s0 q0 s1 q1 s2 q2 s3 q3] -> [s0 s1 s2 s3 | q0 q1 q2 q3]
+        window = _mm256_permutevar8x32_epi32(window, separate);
+
+        #define TO_DOUBLE(x) _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_cvtepu32_epi64(x), magicBits)), magic)
+        __m256d windowSum = TO_DOUBLE(_mm256_castsi256_si128(window));
+        __m256d pow2ToVar = TO_DOUBLE(_mm256_extracti128_si256(window, 1));
+        #undef TO_DOUBLE
+
+        __m256d windowAvg = _mm256_div_pd(windowSum, windowSizeVector);
+        __m256d variance = _mm256_div_pd(
+            _mm256_sub_pd(pow2ToVar, _mm256_mul_pd(windowSizeVector, _mm256_mul_pd(windowAvg, windowAvg))),
+            windowSizeVector);
+
+        __m256d better = _mm256_cmp_pd(variance, bestVariance, _CMP_LT_OQ);
+        bestVariance = _mm256_blendv_pd(bestVariance, variance, better);
+        bestAverage = _mm256_blendv_pd(bestAverage, windowAvg, better);
+        bestJ = _mm256_blendv_pd(bestJ, jLanes, better);
+        jLanes = _mm256_add_pd(jLanes, four);
+    }
+
+    reduceAvx2Lanes(bestVariance, bestAverage, bestJ, i, varianceResult);
+    scanIntegralRowTail(integral, i, tSize, j, varianceResult);
+}
+
+/*
+ * Modo exato (--exact). Com n = t * w pixels, S1 = soma e S2 = soma dos quadrados da
+ * janela, n² * variância = n * S2 - S1², que é um inteiro. Como n é o mesmo para todas
+ * as janelas de um tamanho, comparar n * S2 - S1² é o mesmo que comparar as variâncias,
+ * sem a subtração de dois doubles quase iguais e sem nenhuma divisão no laço; a
+ * variância e a média em double só são calculadas para a janela vencedora.
+ *
+ * O produto n * S2 precisa de mais bits que a tabela. withIntegralType só escolhe as
+ * tabelas módulo 2^32 quando maxGray² * n <= 2^32 - 1 (getWindowIntegralBound), então
+ * S2 <= maxGray² * n < 2^32 e n * S2 <= (2^32 - 1) * n < 2^64. Com maxGray = 1 a janela
+ * pode ter quase 2^32 pixels e o produto passa de 2^63, por isso a conta é feita em
+ * unsigned long long: ela é exata módulo 2^64 e o resultado, no máximo
+ * n² * maxGray² / 4 < 2^62, cabe sem volta. Com as tabelas de 64 bits é usado
+ * __int128. As tabelas de 128 bits e de double continuam na comparação em double.
+ */
+template <typename A> struct ExactVarianceType { typedef __int128 type; static const bool supported = false; };
+template <> struct ExactVarianceType<uint32_t> { typedef unsigned long long type; static const bool supported = true; };
+template <> struct ExactVarianceType<long long> { typedef __int128 type; static const bool supported = true; };
+template <> struct ExactVarianceType<unsigned long long> { typedef __int128 type; static const bool supported = true; };
+
+template <typename A>
+bool canScanExactly(IntegralImage<A>* integral){
+    return exactVariance && ExactVarianceType<A>::supported && integral->moments >= 2;
+}
+
+void setExactVarianceResult(VarianceResult* varianceResult, int i, int j, __int128 scaledVariance, __int128 windowSum, long tSize){
+    double windowSize = tSize*getWindowWidth(tSize);
+    varianceResult->iLowestVar = i;
+    varianceResult->jLowestVar = j;
+    varianceResult->scaledVariance = scaledVariance;
+    varianceResult->lowestVariance = (double) scaledVariance / (windowSize * windowSize);
+    varianceResult->windowAverage = (double) windowSum / windowSize;
+}
+
+template <typename A>
+void scanIntegralRowExact(IntegralImage<A>* integral, int i, long tSize, int jBegin, VarianceResult* varianceResult){
+    typedef typename ExactVarianceType<A>::type E;
+    long tWidth = getWindowWidth(tSize);
+    E windowSize = tSize*tWidth;
+    int moments = integral->moments;
+    int jCount = integral->jMax - (tWidth -1);
+    int step = moments * jStride;
+    A* cellA = integralRowAt(integral, i) + jBegin * moments;
+    A* cellB = cellA + tWidth * moments;
+    A* cellD = integralRowAt(integral, i + tSize) + jBegin * moments;
+    A* cellC = cellD + tWidth * moments;
+
+    bool found = varianceResult->iLowestVar >= 0;
+    E lowest = found ? (E) varianceResult->scaledVariance : 0;
+    E lowestSum = 0;
+    int jLowest = -1;
+    for(int j = jBegin; j < jCount; j += jStride){
+        E windowSum = (A) (cellC[0] - cellB[0] - cellD[0] + cellA[0]);
+        E pow2Sum = (A) (cellC[1] - cellB[1] - cellD[1] + cellA[1]);
+        E scaledVariance = windowSize * pow2Sum - windowSum * windowSum;
+        if(!found || scaledVariance < lowest){
+            found = true;
+            lowest = scaledVariance;
+            lowestSum = windowSum;
+            jLowest = j;
+        }
+        cellA += step;
+        cellB += step;
+        cellC += step;
+        cellD += step;
+    }
+    if(jLowest >= 0){
+        setExactVarianceResult(varianceResult, i, jLowest, lowest, lowestSum, tSize);
+    }
+}
+
+/*
+ * Modo exato em AVX2 para as tabelas módulo 2^32: as somas da janela saem como no
+ * núcleo em double, já estendidas para 64 bits, e n * S2 - S1² é feito com
+ * _mm256_mul_epu32 (32 x 32 -> 64 bits) e comparado com _mm256_cmpgt_epi64, só com
+ * inteiros. Os produtos são exatos em 64 bits sem sinal e a subtração, módulo 2^64, dá
+ * o resultado exato, que é menor que 2^62 (ver ExactVarianceType), então a comparação
+ * com sinal está certa.
+ */
+template <typename A>
+bool canScanExactlyWithAvx2(IntegralImage<A>* integral){
+    return false;
+}
+
+bool canScanExactlyWithAvx2(IntegralImage<uint32_t>* integral){
+    return simdEnabled && hasAvx2() && integral->moments == 2;
+}
+
+template <typename A>
+void scanIntegralRowExactAvx2(IntegralImage<A>* integral, int i, long tSize, VarianceResult* varianceResult){
+    scanIntegralRowExact(integral, i, tSize, 0, varianceResult);
+}
+
+__attribute__((target("avx2")))
+void scanIntegralRowExactAvx2(IntegralImage<uint32_t>* integral, int i, long tSize, VarianceResult* varianceResult){
+    long tWidth = getWindowWidth(tSize);
+    int jCount = integral->jMax - (tWidth -1);
+    uint32_t* upper = integralRowAt(integral, i);
+    uint32_t* lower = integralRowAt(integral, i + tSize);
+    uint32_t* cellA = upper;
+    uint32_t* cellB = upper + tWidth * 2;
+    uint32_t* cellC = lower + tWidth * 2;
+    uint32_t* cellD = lower;
+
+    const __m256i separate = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256i windowSize = _mm256_set1_epi64x(tSize*tWidth);
+    bool found = varianceResult->iLowestVar >= 0;
+    __m256i lowest = _mm256_set1_epi64x(found ? (long long) varianceResult->scaledVariance : LLONG_MAX);
+    __m256i lowestSum = _mm256_setzero_si256();
+    __m256i lowestJ = _mm256_set1_epi64x(-1);
+    __m256i jLanes = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256i four = _mm256_set1_epi64x(4);
+
+    int j = 0;
+    for(; j + 4 <= jCount; j += 4){
+        __m256i a = _mm256_loadu_si256((__m256i*) (cellA + 2*j));
+        __m256i b = _mm256_loadu_si256((__m256i*) (cellB + 2*j));
+        __m256i c = _mm256_loadu_si256((__m256i*) (cellC + 2*j));
+        __m256i d = _mm256_loadu_si256((__m256i*) (cellD + 2*j));
+        __m256i window = _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(c, b), d), a);
+        window = _mm256_permutevar8x32_epi32(window, separate);
+        __m256i windowSum = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(window));
+        __m256i pow2Sum = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(window, 1));
+        __m256i scaledVariance = _mm256_sub_epi64(_mm256_mul_epu32(windowSize, pow2Sum), _mm256_mul_epu32(windowSum, windowSum));
+
+        __m256i better = _mm256_cmpgt_epi64(lowest, scaledVariance);
+        lowest = _mm256_blendv_epi8(lowest, scaledVariance, better);
+        lowestSum = _mm256_blendv_epi8(lowestSum, windowSum, better);
+        lowestJ = _mm256_blendv_epi8(lowestJ, jLanes, better);
+        jLanes = _mm256_add_epi64(jLanes, four);
+    }
+
+    long long laneLowest[4], laneSum[4], laneJ[4];
+    _mm256_storeu_si256((__m256i*) laneLowest, lowest);
+    _mm256_storeu_si256((__m256i*) laneSum, lowestSum);
+    _mm256_storeu_si256((__m256i*) laneJ, lowestJ);
+    int bestLane = -1;
+    for(int lane = 0; lane < 4; lane++){
+        if(laneJ[lane] < 0) continue;
+        if(bestLane < 0 || laneLowest[lane] < laneLowest[bestLane] ||
+            (laneLowest[lane] == laneLowest[bestLane] && laneJ[lane] < laneJ[bestLane])){
+            bestLane = lane;
+        }
+    }
+    if(bestLane >= 0){
+        setExactVarianceResult(varianceResult, i, (int) laneJ[bestLane], laneLowest[bestLane], laneSum[bestLane], tSize);
+    }
+
+    scanIntegralRowExact(integral, i, tSize, j, varianceResult);
+}
+
+/*
+ * Compara dois candidatos: menor variância e, no empate, o menor (i, j), que é o
+ * mesmo candidato que a varredura sequencial (com "<" estrito) manteria. No modo
+ * exato a comparação usa n² * variância, e não o double arredondado.
+ */
+bool isBetterVarianceResult(VarianceResult* candidate, VarianceResult* current){
+    if(candidate->iLowestVar < 0) return false;
+    if(current->iLowestVar < 0) return true;
+    if(candidate->scaledVariance >= 0 && current->scaledVariance >= 0){
+        if(candidate->scaledVariance != current->scaledVariance){
+            return candidate->scaledVariance < current->scaledVariance;
+        }
+    } else if(candidate->lowestVariance != current->lowestVariance){
+        return candidate->lowestVariance < current->lowestVariance;
+    }
+    if(candidate->iLowestVar != current->iLowestVar){
+        return candidate->iLowestVar < current->iLowestVar;
+    }
+    return candidate->jLowestVar < current->jLowestVar;
+}
+
+/*
+ * Busca em várias escalas: em uma única passada pelas linhas da imagem integral, cada
+ * linha i é usada como borda superior das janelas de todos os tamanhos que cabem a
+ * partir dela, atualizando o melhor resultado de cada tamanho em results[k]. A linha
+ * i é lida uma vez e reaproveitada (já em cache) por todos os tamanhos, ao invés de
+ * uma varredura completa da imagem para cada tamanho. Como cada tamanho continua
+ * visitando os cantos na mesma ordem, os resultados são idênticos aos de varreduras
+ * separadas.
+ *
+ * As linhas da imagem integral são divididas em faixas varridas em paralelo. Cada
+ * faixa mantém o seu melhor resultado por tamanho e a redução final escolhe entre as
+ * faixas com isBetterVarianceResult, então o resultado é idêntico ao sequencial. Os
+ * núcleos AVX2 avaliam janelas vizinhas, então com jStride > 1 a versão escalar é
+ * usada.
+ *
+ * Quem varre várias vezes pode passar em bandBuffer um vetor com bandCapacity faixas
+ * de tSizeCount resultados, que é usado no lugar de um alocado a cada chamada (com no
+ * máximo bandCapacity faixas).
+ */
+int getScanBandCount(int rows){
+    int bandCount = MIN(getThreadCount() * SCAN_BANDS_PER_THREAD, rows);
+    return bandCount < 1 ? 1 : bandCount;
+}
+
+template <typename A>
+void scanIntegralImagesForAllSizes(IntegralImage<A>* integral, long* tSizes, int tSizeCount, VarianceResult* results, double* reduceTime = NULL,
+                                   VarianceResult* bandBuffer = NULL, int bandCapacity = 0){
+    int bandCount = getScanBandCount(integral->iMax);
+    if(bandBuffer) bandCount = MIN(bandCount, bandCapacity);
+    VarianceResult* bandResults = bandBuffer ? bandBuffer : (VarianceResult*) mallocLogging(sizeof(VarianceResult) * bandCount * tSizeCount);
+    bool exact = canScanExactly(integral);
+    bool vectorized = jStride == 1 && (exact ? canScanExactlyWithAvx2(integral) : canScanWithAvx2(integral));
+
+    runInParallel(bandCount, [&](int band){
+        VarianceResult* bandResult = &bandResults[band * tSizeCount];
+        int iBegin = (long) integral->iMax * band / bandCount;
+        int iEnd = (long) integral->iMax * (band + 1) / bandCount;
+        for(int k = 0; k < tSizeCount; k++){
+            initVarianceResult(&bandResult[k], tSizes[k]);
+        }
+        // Primeira linha de canto da faixa que é múltipla de iStride
+        for(int i = (iBegin + iStride - 1) / iStride * iStride; i < iEnd; i += iStride){
+            for(int k = 0; k < tSizeCount; k++){
+                if(i + tSizes[k] <= integral->iMax){
+                    if(exact && vectorized){
+                        scanIntegralRowExactAvx2(integral, i, tSizes[k], &bandResult[k]);
+                    } else if(exact){
+                        scanIntegralRowExact(integral, i, tSizes[k], 0, &bandResult[k]);
+                    } else if(vectorized){
+                        scanIntegralRowAvx2(integral, i, tSizes[k], &bandResult[k]);
+                    } else {
+                        scanIntegralRow(integral, i, tSizes[k], &bandResult[k]);
+                    }
+                }
+            }
+        }
+    });
+
+    double reduceStart = getWallTime();
+    for(int k = 0; k < tSizeCount; k++){
+        initVarianceResult(&results[k], tSizes[k]);
+        for(int band = 0; band < bandCount; band++){
+            if(isBetterVarianceResult(&bandResults[band * tSizeCount + k], &results[k])){
+                results[k] = bandResults[band * tSizeCount + k];
+            }
+        }
+    }
+    if(reduceTime) *reduceTime = getWallTime() - reduceStart;
+    if(!bandBuffer) freeLogging(bandResults);
+}
+
+template <typename A>
+void scanIntegralImagesInto(IntegralImage<A>* integral, long tSize, VarianceResult* varianceResult,
+                            VarianceResult* bandBuffer = NULL, int bandCapacity = 0){
+    scanIntegralImagesForAllSizes(integral, &tSize, 1, varianceResult, NULL, bandBuffer, bandCapacity);
+}
+
+template <typename A>
+VarianceResult* scanIntegralImages(IntegralImage<A>* integral, long tSize){
+    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
+    scanIntegralImagesInto(integral, tSize, varianceResult);
+    return varianceResult;
+}
+
+template <typename T>
+VarianceResult* getVarianceUsingIntegralImage(Image<T> *source, long tSize){
+    typedef typename IntegralType<T>::type A;
+    IntegralImage<A>* integral = generateMomentsIntegralImage(source, 2);
+    if(debugVerbose) printIntegralImage(integral);
+
+    VarianceResult *varianceResult = scanIntegralImages(integral, tSize);
+
+    freeIntegralImage(integral);
+
+    return varianceResult;
+}
+
+// ------------------------------------------ SLIDING WINDOW UTILS ------------------------------------------
+/*
+ * Janela deslizante sem imagens integrais, com memória O(largura). Para cada coluna
+ * guardamos a soma e a soma dos quadrados das últimas tSize linhas (intercaladas, como
+ * os momentos da imagem integral). Cada linha da imagem entra uma vez (incoming) e
+ * sai uma vez, tSize linhas depois (outgoing), então cada pixel é visitado duas
+ * vezes. Com as colunas prontas, a janela desliza na horizontal somando a coluna que
+ * entra e subtraindo a que sai, O(1) por janela. As colunas somam tSize linhas (a
+ * altura) e a janela horizontal tem getWindowWidth(tSize) colunas.
+ *
+ * O acumulador A é o mesmo escolhido por withIntegralType: as somas das colunas e das
+ * janelas também são exatas módulo 2^k nas versões sem sinal. As contas da janela são
+ * as mesmas de scanIntegralRow e scanIntegralRowExact, então o resultado é idêntico ao
+ * das imagens integrais.
+ */
+template <typename A>
+struct SlidingWindow {
+    A* columns; // [soma, soma dos quadrados] de cada coluna nas últimas "rows" linhas
+    int jMax;
+    long tSize;
+    long rows;  // linhas já acumuladas, até tSize
+};
+
+template <typename A>
+SlidingWindow<A>* createSlidingWindow(int jMax, long tSize){
+    SlidingWindow<A>* window = (SlidingWindow<A>*) mallocLogging(sizeof(SlidingWindow<A>));
+    window->columns = (A*) mallocAlignedLogging(IMAGE_ALIGNMENT, sizeof(A) * 2 * (jMax > 0 ? jMax : 1));
+    window->jMax = jMax;
+    window->tSize = tSize;
+    window->rows = 0;
+    memset(window->columns, 0, sizeof(A) * 2 * jMax);
+    return window;
+}
+
+template <typename A>
+void resetSlidingWindow(SlidingWindow<A>* window){
+    window->rows = 0;
+    memset(window->columns, 0, sizeof(A) * 2 * window->jMax);
+}
+
+template <typename A>
+void freeSlidingWindow(SlidingWindow<A>* window){
+    freeLogging(window->columns);
+    freeLogging(window);
+}
+
+/*
+ * Soma a linha "incoming" às colunas e, quando a janela já tem tSize linhas, subtrai
+ * a linha "outgoing", que é a que entrou tSize linhas antes (NULL enquanto a janela
+ * ainda está enchendo).
+ */
+template <typename T, typename A>
+void pushSlidingWindowRow(SlidingWindow<A>* window, T* incoming, T* outgoing){
+    A* columns = window->columns;
+    if(outgoing == NULL){
+        for(int j = 0; j < window->jMax; j++){
+            A pixel = incoming[j];
+            columns[2*j] += pixel;
+            columns[2*j + 1] += pixel * pixel;
+        }
+        window->rows++;
+        return;
+    }
+    for(int j = 0; j < window->jMax; j++){
+        A pixel = incoming[j];
+        A old = outgoing[j];
+        columns[2*j] += pixel - old;
+        columns[2*j + 1] += pixel * pixel - old * old;
+    }
+}
+
+/*
+ * Varre todas as janelas cujas tSize linhas estão nas colunas, com canto superior na
+ * linha i da imagem. Só pode ser chamada com a janela cheia (rows == tSize). A janela
+ * desliza por todas as colunas, mas só os j múltiplos de jStride são avaliados.
+ */
+template <typename A>
+void scanSlidingWindowRow(SlidingWindow<A>* window, int i, VarianceResult* varianceResult){
+    typedef typename ExactVarianceType<A>::type E;
+    long tSize = window->tSize;
+    long tWidth = getWindowWidth(tSize);
+    int jCount = window->jMax - (tWidth -1);
+    if(jCount <= 0) return;
+    A* columns = window->columns;
+    A windowSum = 0, pow2Sum = 0;
+    for(long c = 0; c < tWidth; c++){
+        windowSum += columns[2*c];
+        pow2Sum += columns[2*c + 1];
+    }
+
+    double windowSize = tSize*tWidth;
+    bool exact = exactVariance && ExactVarianceType<A>::supported;
+    bool found = varianceResult->iLowestVar >= 0;
+    E lowestScaled = found && exact ? (E) varianceResult->scaledVariance : 0;
+    E lowestSum = 0;
+    double lowestVariance = varianceResult->lowestVariance;
+    int jLowest = -1;
+    int jNext = 0;
+    for(int j = 0; j < jCount; j++){
+        if(j != jNext){
+            // fora do passo: só desliza
+        } else if(exact){
+            jNext += jStride;
+            E sum = windowSum;
+            E scaledVariance = (E) (tSize*tWidth) * (E) pow2Sum - sum * sum;
+            if(!found || scaledVariance < lowestScaled){
+                found = true;
+                lowestScaled = scaledVariance;
+                lowestSum = sum;
+                jLowest = j;
+            }
+        } else {
+            jNext += jStride;
+            double windowAvg = (double) windowSum / windowSize;
+            double variance = ((double) pow2Sum - windowSize * pow(windowAvg, 2)) / windowSize ;
+            if(variance < lowestVariance){
+                lowestVariance = variance;
+                varianceResult->lowestVariance = variance;
+                varianceResult->windowAverage = windowAvg;
+                varianceResult->iLowestVar = i;
+                varianceResult->jLowestVar = j;
+            }
+        }
+        if(j + tWidth < window->jMax){
+            windowSum += columns[2*(j + tWidth)] - columns[2*j];
+            pow2Sum += columns[2*(j + tWidth) + 1] - columns[2*j + 1];
+        }
+    }
+    if(exact && jLowest >= 0){
+        setExactVarianceResult(varianceResult, i, jLowest, lowestScaled, lowestSum, tSize);
+    }
+}
+
+/*
+ * Todos os tamanhos de uma vez, com uma janela deslizante por tamanho. Cada thread
+ * fica com uma faixa contínua de linhas de canto e começa acumulando as tSize - 1
+ * linhas anteriores, então a memória é O(largura) por thread e tamanho. As linhas são
+ * o laço externo, para que cada linha seja lida da memória uma vez para todos os
+ * tamanhos. A redução entre as faixas é a mesma das imagens integrais.
+ */
+template <typename T, typename A>
+void scanSlidingWindowsForAllSizes(Image<T>* source, A* accumulator, long* tSizes, int tSizeCount, VarianceResult* results){
+    int bandCount = MIN(getThreadCount(), source->iMax);
+    if(bandCount < 1) bandCount = 1;
+    VarianceResult* bandResults = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * bandCount * tSizeCount);
+
+    runInParallel(bandCount, [&](int band){
+        VarianceResult* bandResult = &bandResults[band * tSizeCount];
+        // Linhas de canto (i) desta faixa
+        int iBegin = (long) source->iMax * band / bandCount;
+        int iEnd = (long) source->iMax * (band + 1) / bandCount;
+        long maxTSize = 1;
+        SlidingWindow<A>** windows = (SlidingWindow<A>**) mallocLogging(sizeof(SlidingWindow<A>*) * tSizeCount);
+        for(int k = 0; k < tSizeCount; k++){
+            initVarianceResult(&bandResult[k], tSizes[k]);
+            windows[k] = createSlidingWindow<A>(source->jMax, tSizes[k]);
+            if(tSizes[k] > maxTSize) maxTSize = tSizes[k];
+        }
+        int rowEnd = MIN((long) iEnd + maxTSize - 1, (long) source->iMax);
+        for(int row = iBegin; row < rowEnd; row++){
+            T* incoming = rowAt(source, row);
+            for(int k = 0; k < tSizeCount; k++){
+                long tSize = tSizes[k];
+                if(row >= iEnd + tSize - 1) continue;
+                T* outgoing = row - tSize >= iBegin ? rowAt(source, row - tSize) : NULL;
+                pushSlidingWindowRow(windows[k], incoming, outgoing);
+                long top = row - tSize + 1;
+                if(top >= iBegin && top < iEnd && top % iStride == 0){
+                    scanSlidingWindowRow(windows[k], top, &bandResult[k]);
+                }
+            }
+        }
+        for(int k = 0; k < tSizeCount; k++){
+            freeSlidingWindow(windows[k]);
+        }
+        freeLogging(windows);
+    });
+
+    for(int k = 0; k < tSizeCount; k++){
+        initVarianceResult(&results[k], tSizes[k]);
+        for(int band = 0; band < bandCount; band++){
+            if(isBetterVarianceResult(&bandResults[band * tSizeCount + k], &results[k])){
+                results[k] = bandResults[band * tSizeCount + k];
+            }
+        }
+    }
+    freeLogging(bandResults);
+}
+
+template <typename A, typename T>
+VarianceResult* getVarianceUsingSlidingWindow(Image<T>* source, long tSize){
+    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
+    scanSlidingWindowsForAllSizes(source, (A*) NULL, &tSize, 1, varianceResult);
+    return varianceResult;
+}
+
+// ------------------------------------------ STREAM UTILS ------------------------------------------
+/*
+ * Leitura em faixas (--stream) para imagens maiores que a memória. O arquivo não é
+ * mapeado nem carregado: os bytes são lidos com read() em um buffer de tamanho fixo,
+ * que é reaproveitado a cada faixa, e os pixels vão para um anel com as últimas
+ * maxTSize + 1 linhas, o suficiente para que cada janela deslizante encontre a linha
+ * que sai (tSize linhas antes da que entra). A memória é O(maxTSize * largura), não
+ * importa a altura da imagem.
+ */
+#define STREAM_BUFFER_BYTES (1 << 20)
+
+typedef struct {
+    int fd;
+    char version[3];
+    int iMax;
+    int jMax;
+    long long maxGray;
+    int bytesPerPixel; // somente P5
+    unsigned char* buffer;
+    size_t capacity;
+    size_t begin; // primeiro byte ainda não consumido
+    size_t end;   // fim dos bytes válidos
+    bool endOfFile;
+}PgmStream;
+
+/*
+ * Move os bytes ainda não consumidos para o começo do buffer e lê a próxima faixa
+ * do arquivo em seguida. Retorna falso quando não há mais nada para ler.
+ */
+bool fillPgmStream(PgmStream* stream){
+    if(stream->endOfFile) return false;
+    size_t pending = stream->end - stream->begin;
+    memmove(stream->buffer, stream->buffer + stream->begin, pending);
+    stream->begin = 0;
+    stream->end = pending;
+    ssize_t count = read(stream->fd, stream->buffer + pending, stream->capacity - pending);
+    if(count <= 0){
+        stream->endOfFile = true;
+        return false;
+    }
+    stream->end += count;
+    return true;
+}
+
+/*
+ * Garante espaço para pelo menos "bytes" bytes no buffer (uma linha inteira do P5).
+ */
+void reservePgmStream(PgmStream* stream, size_t bytes){
+    if(bytes <= stream->capacity) return;
+    unsigned char* buffer = (unsigned char*) mallocLogging(bytes);
+    memcpy(buffer, stream->buffer + stream->begin, stream->end - stream->begin);
+    freeLogging(stream->buffer);
+    stream->end -= stream->begin;
+    stream->begin = 0;
+    stream->buffer = buffer;
+    stream->capacity = bytes;
+}
+
+PgmStream* openPgmStream(char* filename){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Unable to open file %s.\n\n", filename);
+        exit(1);
+    }
+    PgmStream* stream = (PgmStream*) mallocLogging(sizeof(PgmStream));
+    stream->fd = fd;
+    stream->capacity = STREAM_BUFFER_BYTES;
+    stream->buffer = (unsigned char*) mallocLogging(stream->capacity);
+    stream->begin = 0;
+    stream->end = 0;
+    stream->endOfFile = false;
+    while(stream->end < stream->capacity && fillPgmStream(stream));
+    if(stream->end < 2){
+        printf("Error: Unable to read file %s.\n\n", filename);
+        exit(1);
+    }
+
+    // O cabeçalho precisa caber na primeira faixa, que é vista como um PGM mapeado
+    MappedPgm header;
+    header.data = stream->buffer;
+    header.size = stream->end;
+    stream->version[0] = stream->buffer[0];
+    stream->version[1] = stream->buffer[1];
+    stream->version[2] = '\0';
+    size_t offset = 2;
+    long long width = readPgmHeaderNumber(&header, &offset);
+    long long height = readPgmHeaderNumber(&header, &offset);
+    struct stat fileStat;
+    checkPgmDimensions(width, height, fstat(fd, &fileStat) == 0 ? fileStat.st_size : LLONG_MAX);
+    stream->jMax = width;
+    stream->iMax = height;
+    stream->maxGray = readPgmHeaderNumber(&header, &offset);
+    // Exatamente um caractere de espaço separa o cabeçalho dos dados
+    stream->begin = MIN(offset + 1, stream->end);
+
+    if(strcmp(stream->version, "P5") == 0){
+        if(stream->maxGray < 1 || stream->maxGray > 65535){
+            printf("Error: Invalid max gray value %lld for binary PGM.\n", stream->maxGray);
+            exit(1);
+        }
+        stream->bytesPerPixel = stream->maxGray < 256 ? 1 : 2;
+        reservePgmStream(stream, (size_t) stream->jMax * stream->bytesPerPixel);
+    } else if(strcmp(stream->version, "P2") == 0){
+        if(stream->maxGray == LLONG_MAX){
+            printf("Error: PGM max gray is greater than long long.\n");
+            exit(1);
+        }
+        stream->bytesPerPixel = 0;
+    } else {
+        printf("Error: Unsupported PGM version %s. Use P2 or P5.\n", stream->version);
+        exit(1);
+    }
+    return stream;
+}
+
+void closePgmStream(PgmStream* stream){
+    close(stream->fd);
+    freeLogging(stream->buffer);
+    freeLogging(stream);
+}
+
+/*
+ * Mesmo critério de readBinaryImage e readAsciiSourceImage para o tipo dos pixels;
+ * function recebe um ponteiro nulo desse tipo.
+ */
+template <typename Function>
+void withPgmStreamType(PgmStream* stream, Function function){
+    if(stream->maxGray <= UINT8_MAX){
+        function((uint8_t*) NULL);
+    } else if(stream->maxGray <= UINT16_MAX){
+        function((uint16_t*) NULL);
+    } else if(stream->maxGray <= UINT32_MAX){
+        function((uint32_t*) NULL);
+    } else {
+        function((long long*) NULL);
+    }
+}
+
+/*
+ * Lê a próxima linha da imagem, buscando novas faixas do arquivo quando o buffer acaba.
+ */
+template <typename T>
+void readPgmStreamRow(PgmStream* stream, T* row){
+    if(stream->bytesPerPixel > 0){
+        size_t rowBytes = (size_t) stream->jMax * stream->bytesPerPixel;
+        while(stream->end - stream->begin < rowBytes){
+            if(!fillPgmStream(stream)){
+                printf("Error: Binary PGM is smaller than its header says.\n");
+                exit(1);
+            }
+        }
+        unsigned char* pixels = stream->buffer + stream->begin;
+        checkBinaryPixels(pixels, stream->jMax, stream->bytesPerPixel, stream->maxGray);
+        if(stream->bytesPerPixel == 1){
+            for(int j = 0; j < stream->jMax; j++) row[j] = pixels[j];
+        } else {
+            for(int j = 0; j < stream->jMax; j++) row[j] = (pixels[2*j] << 8) | pixels[2*j + 1];
+        }
+        stream->begin += rowBytes;
+        return;
+    }
+
+    for(int j = 0; j < stream->jMax; j++){
+        // Espaços antes do número
+        while(true){
+            if(stream->begin == stream->end && !fillPgmStream(stream)){
+                printf("Error: PGM has fewer pixels than its header says.\n");
+                exit(1);
+            }
+            if(!isPgmSpace(stream->buffer[stream->begin])) break;
+            stream->begin++;
+        }
+        unsigned char c = stream->buffer[stream->begin];
+        if(c == '-'){
+            printf("Error: number from PGM is lower than zero. Maybe PGM file max gray scale is greater than long long?");
+            exit(1);
+        }
+        if(c < '0' || c > '9'){
+            printf("Error: Invalid character '%c' in PGM body.\n", c);
+            exit(1);
+        }
+        long long number = 0;
+        while(true){
+            if(stream->begin == stream->end && !fillPgmStream(stream)) break;
+            c = stream->buffer[stream->begin];
+            if(c < '0' || c > '9') break;
+            number = number > (LLONG_MAX - 9) / 10 ? LLONG_MAX : number * 10 + (c - '0');
+            stream->begin++;
+        }
+        if(number > stream->maxGray){
+            printf("Error: Pixel %lld is greater than PGM max gray %lld.\n", number, stream->maxGray);
+            exit(1);
+        }
+        row[j] = (T) number;
+    }
+}
+
+/*
+ * Varre o arquivo uma única vez, linha a linha, alimentando uma janela deslizante por
+ * tamanho. Como na versão em memória, a linha i só é varrida quando as suas tSize
+ * linhas já entraram, então o resultado é idêntico ao de scanSlidingWindowsForAllSizes.
+ */
+template <typename T, typename A>
+void scanPgmStreamRows(PgmStream* stream, Image<T>* ring, A* accumulator, long* tSizes, int tSizeCount, VarianceResult* results){
+    SlidingWindow<A>** windows = (SlidingWindow<A>**) mallocLogging(sizeof(SlidingWindow<A>*) * tSizeCount);
+    for(int k = 0; k < tSizeCount; k++){
+        initVarianceResult(&results[k], tSizes[k]);
+        windows[k] = createSlidingWindow<A>(stream->jMax, tSizes[k]);
+    }
+    for(int row = 0; row < stream->iMax; row++){
+        T* incoming = rowAt(ring, row % ring->iMax);
+        readPgmStreamRow(stream, incoming);
+        for(int k = 0; k < tSizeCount; k++){
+            long tSize = tSizes[k];
+            T* outgoing = row >= tSize ? rowAt(ring, (row - tSize) % ring->iMax) : NULL;
+            pushSlidingWindowRow(windows[k], incoming, outgoing);
+            if(row >= tSize - 1 && (row - tSize + 1) % iStride == 0){
+                scanSlidingWindowRow(windows[k], row - tSize + 1, &results[k]);
+            }
+        }
+    }
+    for(int k = 0; k < tSizeCount; k++){
+        freeSlidingWindow(windows[k]);
+    }
+    freeLogging(windows);
+}
+
+/*
+ * Variância mínima de todos os tamanhos lendo "filename" em faixas. O acumulador das
+ * janelas é escolhido por withIntegralType sobre o próprio anel: as somas das colunas
+ * e das janelas nunca passam das somas de maxTSize + 1 linhas.
+ */
+void scanPgmStreamForAllSizes(char* filename, long* tSizes, int tSizeCount, VarianceResult* results){
+    PgmStream* stream = openPgmStream(filename);
+    long maxTSize = 1;
+    for(int k = 0; k < tSizeCount; k++){
+        if(tSizes[k] > maxTSize) maxTSize = tSizes[k];
+    }
+    withPgmStreamType(stream, [&](auto* pixelType){
+        typedef typename std::remove_pointer<decltype(pixelType)>::type T;
+        Image<T>* ring = allocateImage<T>(MIN(maxTSize, (long) stream->iMax) + 1, stream->jMax);
+        withIntegralType(ring, stream->maxGray, 2, maxTSize, [&](auto* accumulator){
+            scanPgmStreamRows(stream, ring, accumulator, tSizes, tSizeCount, results);
+        });
+        freeImage(ring);
+    });
+    closePgmStream(stream);
+}
+
+// ------------------------------------------ WORKSPACE UTILS ------------------------------------------
+/*
+ * Área de trabalho de uma imagem para as varreduras com vários tamanhos de janela
+ * (tSize = -1). A imagem integral é gerada uma única vez na criação e compartilhada
+ * por todos os tamanhos e repetições, e os resultados ficam em um vetor alocado de
+ * antemão com uma posição por tamanho. Os resultados parciais das faixas também são
+ * alocados na criação, para o número de threads desse momento. Assim N tamanhos
+ * custam uma geração e N varreduras, sem nenhuma alocação no meio. O acumulador A da
+ * imagem integral é o escolhido por withIntegralType.
+ */
+template <typename T, typename A>
+struct VarianceWorkspace {
+    Image<T>* source;
+    IntegralImage<A>* integral;
+    long* tSizes;
+    VarianceResult* results;
+    int tSizeCount;
+    VarianceResult* bandResults; // bandCapacity faixas de tSizeCount resultados
+    int bandCapacity;
+    double buildTime;  // tempo de parede da última geração da imagem integral
+    double scanTime;   // tempo de parede da última varredura das faixas, todos os tamanhos
+    double reduceTime; // tempo de parede da redução entre as faixas da última varredura
+};
+
+template <typename T, typename A>
+VarianceWorkspace<T, A>* createVarianceWorkspace(Image<T>* source, A* accumulator, long* tSizes, int tSizeCount){
+    VarianceWorkspace<T, A>* workspace = (VarianceWorkspace<T, A>*) mallocLogging(sizeof(VarianceWorkspace<T, A>));
+    workspace->source = source;
+    workspace->tSizes = tSizes;
+    workspace->tSizeCount = tSizeCount;
+    workspace->results = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * tSizeCount);
+    workspace->bandCapacity = getScanBandCount(source->iMax);
+    workspace->bandResults = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * workspace->bandCapacity * tSizeCount);
+    workspace->scanTime = 0;
+    workspace->reduceTime = 0;
+
+    double start = getWallTime();
+    workspace->integral = generateMomentsIntegralImageAs<A>(source, 2);
+    workspace->buildTime = getWallTime() - start;
+    if(debugVerbose) printIntegralImage(workspace->integral);
+    return workspace;
+}
+
+template <typename T, typename A>
+void freeVarianceWorkspace(VarianceWorkspace<T, A>* workspace){
+    freeIntegralImage(workspace->integral);
+    freeLogging(workspace->results);
+    freeLogging(workspace->bandResults);
+    freeLogging(workspace);
+}
+
+/*
+ * Variância mínima para o tamanho tSizes[sizeIndex] usando a imagem integral da área
+ * de trabalho. O resultado pertence à área de trabalho e não deve ser liberado.
+ */
+template <typename T, typename A>
+VarianceResult* getVarianceUsingWorkspace(VarianceWorkspace<T, A>* workspace, int sizeIndex){
+    VarianceResult* result = &workspace->results[sizeIndex];
+    scanIntegralImagesInto(workspace->integral, workspace->tSizes[sizeIndex], result, workspace->bandResults, workspace->bandCapacity);
+    return result;
+}
+
+/*
+ * Gera de novo a imagem integral sobre a mesma tabela, para medir a geração em
+ * várias repetições sem alocar nada.
+ */
+template <typename T, typename A>
+void rebuildWorkspaceIntegral(VarianceWorkspace<T, A>* workspace){
+    double start = getWallTime();
+    buildMomentsIntegralImage(workspace->source, workspace->integral);
+    workspace->buildTime = getWallTime() - start;
+}
+
+/*
+ * Preenche os resultados de todos os tamanhos com uma única varredura em várias
+ * escalas (scanIntegralImagesForAllSizes), separando o tempo das faixas do tempo da
+ * redução.
+ */
+template <typename T, typename A>
+void getVarianceForAllSizes(VarianceWorkspace<T, A>* workspace){
+    double start = getWallTime();
+    scanIntegralImagesForAllSizes(workspace->integral, workspace->tSizes, workspace->tSizeCount, workspace->results, &workspace->reduceTime,
+                                  workspace->bandResults, workspace->bandCapacity);
+    workspace->scanTime = getWallTime() - start - workspace->reduceTime;
+}
+
+// ------------------------------------------ MAP UTILS ------------------------------------------
+/*
+ * Mapas completos de média e variância local: a posição (i, j) de cada mapa é a média
+ * e a variância da janela t x w com canto em (i * iStride, j * jStride), ou seja, sem
+ * passo cada mapa tem (iMax - t + 1) x (jMax - w + 1) posições. Os valores saem das mesmas contas da
+ * varredura das imagens integrais (inclusive no modo --exact) e são guardados em
+ * float, que é o que os filtros e segmentadores que usam os mapas esperam.
+ */
+typedef struct {
+    Image<float>* mean;
+    Image<float>* variance;
+    long tSize;
+}VarianceMaps;
+
+/*
+ * Variância de uma janela a partir das suas somas, pela conta exata quando "exact"
+ * ou pela mesma conta em double de scanIntegralRow.
+ */
+template <typename A>
+inline double getWindowVariance(A windowSum, A pow2Sum, long tSize, bool exact){
+    typedef typename ExactVarianceType<A>::type E;
+    long windowPixels = tSize*getWindowWidth(tSize);
+    double windowSize = windowPixels;
+    if(exact){
+        E scaledVariance = (E) windowPixels * (E) pow2Sum - (E) windowSum * (E) windowSum;
+        return (double) scaledVariance / (windowSize * windowSize);
+    }
+    double windowAvg = (double) windowSum / windowSize;
+    return ((double) pow2Sum - windowSize * pow(windowAvg, 2)) / windowSize ;
+}
+
+template <typename A>
+void mapIntegralRow(IntegralImage<A>* integral, int i, long tSize, float* meanRow, float* varianceRow){
+    bool exact = exactVariance && ExactVarianceType<A>::supported;
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    int moments = integral->moments;
+    int step = moments * jStride;
+    int jCount = integral->jMax - (tWidth -1);
+    A* cellA = integralRowAt(integral, i);
+    A* cellB = cellA + tWidth * moments;
+    A* cellD = integralRowAt(integral, i + tSize);
+    A* cellC = cellD + tWidth * moments;
+    for(int j = 0; j < jCount; j += jStride){
+        A windowSum = cellC[0] - cellB[0] - cellD[0] + cellA[0];
+        A pow2Sum = cellC[1] - cellB[1] - cellD[1] + cellA[1];
+        meanRow[j / jStride] = (double) windowSum / windowSize;
+        varianceRow[j / jStride] = getWindowVariance(windowSum, pow2Sum, tSize, exact);
+        cellA += step;
+        cellB += step;
+        cellC += step;
+        cellD += step;
+    }
+}
+
+/*
+ * Gera os mapas de um tamanho com faixas de linhas em paralelo. Retorna NULL quando
+ * a janela não cabe na imagem.
+ */
+template <typename A>
+VarianceMaps* computeVarianceMaps(IntegralImage<A>* integral, long tSize){
+    int iCount = integral->iMax - (tSize -1);
+    int jCount = integral->jMax - (getWindowWidth(tSize) -1);
+    if(iCount <= 0 || jCount <= 0) return NULL;
+    iCount = (iCount + iStride - 1) / iStride;
+    jCount = (jCount + jStride - 1) / jStride;
+
+    VarianceMaps* maps = (VarianceMaps*) mallocLogging(sizeof(VarianceMaps));
+    maps->mean = allocateImage<float>(iCount, jCount);
+    maps->variance = allocateImage<float>(iCount, jCount);
+    maps->tSize = tSize;
+    int bandCount = MIN(getThreadCount() * SCAN_BANDS_PER_THREAD, iCount);
+    runInParallel(bandCount, [&](int band){
+        int iBegin = (long) iCount * band / bandCount;
+        int iEnd = (long) iCount * (band + 1) / bandCount;
+        for(int i = iBegin; i < iEnd; i++){
+            mapIntegralRow(integral, i * iStride, tSize, rowAt(maps->mean, i), rowAt(maps->variance, i));
+        }
+    });
+    return maps;
+}
+
+void freeVarianceMaps(VarianceMaps* maps){
+    freeImage(maps->mean);
+    freeImage(maps->variance);
+    freeLogging(maps);
+}
+
+FILE* openOutputFile(char* filename){
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("Error: Unable to write file %s.\n\n", filename);
+        exit(1);
+    }
+    return file;
+}
+
+/*
+ * Mapa em float no formato PFM ("Pf", um canal). A escala negativa indica
+ * little-endian e as linhas vão de baixo para cima, como o formato pede.
+ */
+void writeFloatMap(Image<float>* map, char* filename){
+    FILE* file = openOutputFile(filename);
+    fprintf(file, "Pf\n%d %d\n-1.0\n", map->jMax, map->iMax);
+    for(int i = map->iMax - 1; i >= 0; i--){
+        fwrite(rowAt(map, i), sizeof(float), map->jMax, file);
+    }
+    fclose(file);
+}
+
+/*
+ * Mapa de calor em P5 de 8 bits, normalizado linearmente entre o menor e o maior
+ * valor do mapa (0 e 255).
+ */
+void writeHeatmap(Image<float>* map, char* filename){
+    float lowest = pixelAt(map, 0, 0), highest = lowest;
+    for(int i = 0; i < map->iMax; i++){
+        float* row = rowAt(map, i);
+        for(int j = 0; j < map->jMax; j++){
+            if(row[j] < lowest) lowest = row[j];
+            if(row[j] > highest) highest = row[j];
+        }
+    }
+    double scale = highest > lowest ? 255.0 / ((double) highest - lowest) : 0;
+
+    FILE* file = openOutputFile(filename);
+    fprintf(file, "P5\n%d %d\n255\n", map->jMax, map->iMax);
+    unsigned char* line = (unsigned char*) mallocLogging(map->jMax);
+    for(int i = 0; i < map->iMax; i++){
+        float* row = rowAt(map, i);
+        for(int j = 0; j < map->jMax; j++){
+            line[j] = (unsigned char) ((row[j] - lowest) * scale + 0.5);
+        }
+        fwrite(line, 1, map->jMax, file);
+    }
+    freeLogging(line);
+    fclose(file);
+}
+
+/*
+ * Grava prefix-mean-T.pfm, prefix-variance-T.pfm e os mapas de calor .pgm.
+ */
+void writeVarianceMaps(VarianceMaps* maps, char* prefix){
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s-mean-%ld.pfm", prefix, maps->tSize);
+    writeFloatMap(maps->mean, filename);
+    snprintf(filename, sizeof(filename), "%s-variance-%ld.pfm", prefix, maps->tSize);
+    writeFloatMap(maps->variance, filename);
+    snprintf(filename, sizeof(filename), "%s-mean-%ld.pgm", prefix, maps->tSize);
+    writeHeatmap(maps->mean, filename);
+    snprintf(filename, sizeof(filename), "%s-variance-%ld.pgm", prefix, maps->tSize);
+    writeHeatmap(maps->variance, filename);
+}
+
+// ------------------------------------------ TOP-K UTILS ------------------------------------------
+/*
+ * As K janelas de menor variância, separadas entre si. Uma única janela mínima é
+ * frágil: uma região lisa domina o resultado. Durante a varredura (uma só, a mesma
+ * das imagens integrais) cada faixa guarda as melhores janelas em um heap limitado
+ * cujo topo é a pior delas. Os heaps das faixas são juntados e uma supressão gulosa,
+ * da menor variância para a maior, descarta as janelas a menos de iSpacing linhas e
+ * jSpacing colunas de uma já aceita (t e w descartam as janelas que se sobrepõem). A
+ * mediana das variâncias aceitas é a estimativa robusta do ruído.
+ *
+ * Cada heap guarda K x TOP_CANDIDATES_PER_WINDOW janelas, então a memória não depende
+ * do tamanho da imagem, e os heaps juntos contêm as M melhores posições da imagem
+ * inteira. A supressão gulosa sobre essas M janelas dá exatamente as primeiras
+ * janelas da supressão sobre todas as posições, mas janelas vizinhas têm variâncias
+ * parecidas e podem ocupar todo o heap: nesse caso menos de K janelas são
+ * retornadas (a mediana é a delas), sem uma segunda varredura.
+ */
+#define TOP_CANDIDATES_PER_WINDOW 64
+
+typedef struct {
+    int i;
+    int j;
+    double variance;
+    double windowAverage;
+}WindowCandidate;
+
+typedef struct {
+    WindowCandidate* items; // heap de máximo: items[0] é a pior janela guardada
+    int count;
+    int capacity;
+}CandidateHeap;
+
+typedef struct {
+    WindowCandidate* windows; // em ordem crescente de variância
+    int count;
+    long tSize;
+    long iSpacing;
+    long jSpacing;
+    double medianVariance;
+}TopVarianceResult;
+
+bool isWorseCandidate(WindowCandidate* a, WindowCandidate* b){
+    if(a->variance != b->variance) return a->variance > b->variance;
+    if(a->i != b->i) return a->i > b->i;
+    return a->j > b->j;
+}
+
+CandidateHeap* createCandidateHeap(long capacity){
+    if(capacity < 1 || capacity > INT_MAX){
+        printf("Error: Invalid candidate heap capacity %ld.\n", capacity);
+        exit(1);
+    }
+    CandidateHeap* heap = (CandidateHeap*) mallocLogging(sizeof(CandidateHeap));
+    heap->items = (WindowCandidate*) mallocLogging(sizeof(WindowCandidate) * capacity);
+    heap->count = 0;
+    heap->capacity = capacity;
+    return heap;
+}
+
+void freeCandidateHeap(CandidateHeap* heap){
+    freeLogging(heap->items);
+    freeLogging(heap);
+}
+
+void swapCandidates(WindowCandidate* a, WindowCandidate* b){
+    WindowCandidate temporary = *a;
+    *a = *b;
+    *b = temporary;
+}
+
+/*
+ * Insere a janela se ainda há espaço ou se ela é melhor que a pior guardada.
+ */
+void pushCandidate(CandidateHeap* heap, WindowCandidate* candidate){
+    WindowCandidate* items = heap->items;
+    if(heap->count < heap->capacity){
+        int child = heap->count++;
+        items[child] = *candidate;
+        while(child > 0 && isWorseCandidate(&items[child], &items[(child - 1) / 2])){
+            swapCandidates(&items[child], &items[(child - 1) / 2]);
+            child = (child - 1) / 2;
+        }
+        return;
+    }
+    if(!isWorseCandidate(&items[0], candidate)) return;
+    items[0] = *candidate;
+    int parent = 0;
+    while(true){
+        int worst = parent;
+        int left = 2 * parent + 1, right = left + 1;
+        if(left < heap->count && isWorseCandidate(&items[left], &items[worst])) worst = left;
+        if(right < heap->count && isWorseCandidate(&items[right], &items[worst])) worst = right;
+        if(worst == parent) break;
+        swapCandidates(&items[parent], &items[worst]);
+        parent = worst;
+    }
+}
+
+/*
+ * Manda para o heap as janelas que começam na linha i.
+ */
+template <typename A>
+void collectIntegralRowCandidates(IntegralImage<A>* integral, int i, long tSize, CandidateHeap* heap){
+    bool exact = exactVariance && ExactVarianceType<A>::supported;
+    long tWidth = getWindowWidth(tSize);
+    double windowSize = tSize*tWidth;
+    int moments = integral->moments;
+    int step = moments * jStride;
+    int jCount = integral->jMax - (tWidth -1);
+    A* cellA = integralRowAt(integral, i);
+    A* cellB = cellA + tWidth * moments;
+    A* cellD = integralRowAt(integral, i + tSize);
+    A* cellC = cellD + tWidth * moments;
+    WindowCandidate candidate;
+    candidate.i = i;
+    for(int j = 0; j < jCount; j += jStride){
+        A windowSum = cellC[0] - cellB[0] - cellD[0] + cellA[0];
+        A pow2Sum = cellC[1] - cellB[1] - cellD[1] + cellA[1];
+        candidate.variance = getWindowVariance(windowSum, pow2Sum, tSize, exact);
+        candidate.j = j;
+        if(heap->count < heap->capacity || isWorseCandidate(&heap->items[0], &candidate)){
+            candidate.windowAverage = (double) windowSum / windowSize;
+            pushCandidate(heap, &candidate);
+        }
+        cellA += step;
+        cellB += step;
+        cellC += step;
+        cellD += step;
+    }
+}
+
+int compareCandidates(const void* a, const void* b){
+    WindowCandidate* first = (WindowCandidate*) a;
+    WindowCandidate* second = (WindowCandidate*) b;
+    if(isWorseCandidate(second, first)) return -1;
+    if(isWorseCandidate(first, second)) return 1;
+    return 0;
+}
+
+template <typename A>
+TopVarianceResult* getTopVarianceWindows(IntegralImage<A>* integral, long tSize, int k, long iSpacing, long jSpacing){
+    long capacity = (long) k * TOP_CANDIDATES_PER_WINDOW;
+    int iCount = integral->iMax - (tSize -1);
+    int bandCount = MIN(getThreadCount() * SCAN_BANDS_PER_THREAD, iCount);
+    if(bandCount < 1) bandCount = 1;
+    CandidateHeap** bandHeaps = (CandidateHeap**) mallocLogging(sizeof(CandidateHeap*) * bandCount);
+    runInParallel(bandCount, [&](int band){
+        bandHeaps[band] = createCandidateHeap(capacity);
+        int iBegin = (long) iCount * band / bandCount;
+        int iEnd = (long) iCount * (band + 1) / bandCount;
+        for(int i = (iBegin + iStride - 1) / iStride * iStride; i < iEnd; i += iStride){
+            collectIntegralRowCandidates(integral, i, tSize, bandHeaps[band]);
+        }
+    });
+
+    // Junta as faixas: a ordem total de isWorseCandidate torna o resultado determinístico
+    CandidateHeap* heap = createCandidateHeap(capacity);
+    for(int band = 0; band < bandCount; band++){
+        for(int c = 0; c < bandHeaps[band]->count; c++){
+            pushCandidate(heap, &bandHeaps[band]->items[c]);
+        }
+        freeCandidateHeap(bandHeaps[band]);
+    }
+    freeLogging(bandHeaps);
+    qsort(heap->items, heap->count, sizeof(WindowCandidate), compareCandidates);
+
+    TopVarianceResult* result = (TopVarianceResult*) mallocLogging(sizeof(TopVarianceResult));
+    result->windows = (WindowCandidate*) mallocLogging(sizeof(WindowCandidate) * k);
+    result->count = 0;
+    result->tSize = tSize;
+    result->iSpacing = iSpacing;
+    result->jSpacing = jSpacing;
+    for(int c = 0; c < heap->count && result->count < k; c++){
+        WindowCandidate* candidate = &heap->items[c];
+        bool suppressed = false;
+        for(int a = 0; a < result->count && !suppressed; a++){
+            long di = labs((long) candidate->i - result->windows[a].i);
+            long dj = labs((long) candidate->j - result->windows[a].j);
+            suppressed = di < iSpacing && dj < jSpacing;
+        }
+        if(!suppressed) result->windows[result->count++] = *candidate;
+    }
+    freeCandidateHeap(heap);
+
+    // As janelas aceitas já estão em ordem crescente de variância
+    result->medianVariance = 0;
+    if(result->count > 0){
+        int middle = result->count / 2;
+        result->medianVariance = result->count % 2 == 1 ? result->windows[middle].variance
+            : (result->windows[middle - 1].variance + result->windows[middle].variance) / 2;
+    }
+    return result;
+}
+
+void freeTopVarianceResult(TopVarianceResult* result){
+    freeLogging(result->windows);
+    freeLogging(result);
+}
+
+// ------------------------------------------ CACHE UTILS ------------------------------------------
+/*
+ * Cache em disco das imagens integrais (--cache diretório), para consultar a mesma
+ * imagem com vários tamanhos em execuções separadas. A chave é o hash FNV-1a de 64
+ * bits do arquivo PGM inteiro (cabeçalho incluso) e o tipo do acumulador, que muda
+ * com o tamanho das janelas (veja withIntegralType):
+ *
+ *     <diretório>/<hash em hexadecimal>-<acumulador>.integral
+ *
+ * O arquivo tem um cabeçalho de INTEGRAL_CACHE_HEADER_BYTES bytes e em seguida a
+ * tabela exatamente como na memória (iMax + 1 linhas de "stride" elementos, com a
+ * borda zerada), então uma execução seguinte só calcula o hash e mapeia a tabela com
+ * mmap, sem interpretar o PGM nem gerar nada. O arquivo é escrito com outro nome e
+ * renomeado no fim, então uma execução concorrente nunca mapeia um cache pela
+ * metade; um cache que não confere com o cabeçalho esperado é ignorado e regravado.
+ */
+#define INTEGRAL_CACHE_HEADER_BYTES 64
+#define INTEGRAL_CACHE_MAGIC "PGMINTG1"
+
+typedef struct {
+    char magic[8];
+    uint64_t contentHash;
+    long long maxGray;
+    long stride;
+    int iMax;
+    int jMax;
+    int moments;
+    int accumulatorBytes;
+}IntegralCacheHeader;
+
+uint64_t hashFnv1a(unsigned char* data, size_t size){
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t b = 0; b < size; b++){
+        hash ^= data[b];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+char const* getIntegralTypeName(uint32_t*){ return "u32"; }
+char const* getIntegralTypeName(long long*){ return "i64"; }
+char const* getIntegralTypeName(unsigned long long*){ return "u64"; }
+char const* getIntegralTypeName(unsigned __int128*){ return "u128"; }
+char const* getIntegralTypeName(double*){ return "f64"; }
+
+template <typename A>
+void getIntegralCachePath(char* path, size_t size, char* directory, uint64_t hash){
+    snprintf(path, size, "%s/%016llx-%s.integral", directory, (unsigned long long) hash, getIntegralTypeName((A*) NULL));
+}
+
+/*
+ * Mapeia o cache "path" se ele existir e conferir com a imagem esperada; caso
+ * contrário retorna NULL. A tabela mapeada é somente leitura.
+ */
+template <typename A>
+IntegralImage<A>* openIntegralCache(char* path, uint64_t hash, int iMax, int jMax, int moments){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) < 0 || fileStat.st_size < INTEGRAL_CACHE_HEADER_BYTES){
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+
+    IntegralCacheHeader* header = (IntegralCacheHeader*) data;
+    size_t tableBytes = (size_t) header->stride * sizeof(A) * (iMax + 1);
+    if(memcmp(header->magic, INTEGRAL_CACHE_MAGIC, 8) != 0 || header->contentHash != hash ||
+        header->iMax != iMax || header->jMax != jMax || header->moments != moments ||
+        header->accumulatorBytes != (int) sizeof(A) || header->stride < (long) (jMax + 1) * moments ||
+        (size_t) fileStat.st_size != INTEGRAL_CACHE_HEADER_BYTES + tableBytes){
+        munmap(data, fileStat.st_size);
+        return NULL;
+    }
+
+    IntegralImage<A>* integral = (IntegralImage<A>*) mallocLogging(sizeof(IntegralImage<A>));
+    integral->array = (A*) ((unsigned char*) data + INTEGRAL_CACHE_HEADER_BYTES);
+    integral->stride = header->stride;
+    integral->iMax = iMax;
+    integral->jMax = jMax;
+    integral->moments = moments;
+    integral->mapping = data;
+    integral->mappedBytes = fileStat.st_size;
+    return integral;
+}
+
+template <typename A>
+void writeIntegralCache(char* path, IntegralImage<A>* integral, uint64_t hash, long long maxGray){
+    unsigned char headerBytes[INTEGRAL_CACHE_HEADER_BYTES];
+    memset(headerBytes, 0, sizeof(headerBytes));
+    IntegralCacheHeader* header = (IntegralCacheHeader*) headerBytes;
+    memcpy(header->magic, INTEGRAL_CACHE_MAGIC, 8);
+    header->contentHash = hash;
+    header->maxGray = maxGray;
+    header->stride = integral->stride;
+    header->iMax = integral->iMax;
+    header->jMax = integral->jMax;
+    header->moments = integral->moments;
+    header->accumulatorBytes = sizeof(A);
+
+    char temporaryPath[4096];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", path, (int) getpid());
+    FILE* file = openOutputFile(temporaryPath);
+    size_t elements = (size_t) integral->stride * (integral->iMax + 1);
+    if(fwrite(headerBytes, 1, sizeof(headerBytes), file) != sizeof(headerBytes) ||
+        fwrite(integral->array, sizeof(A), elements, file) != elements || fclose(file) != 0){
+        printf("Error: Could not write %s.\n", temporaryPath);
+        exit(1);
+    }
+    if(rename(temporaryPath, path) != 0){
+        printf("Error: Could not write %s.\n", path);
+        exit(1);
+    }
+}
+
+/*
+ * Imagem integral de "filename" com o acumulador A, mapeada do cache quando ele
+ * existe, ou gerada a partir da imagem (que é lida só neste caso) e gravada no cache.
+ */
+template <typename A>
+IntegralImage<A>* loadIntegralImage(char* filename, char* cacheDirectory, MappedPgm* pgm, uint64_t hash, bool* cached){
+    char path[4096];
+    getIntegralCachePath<A>(path, sizeof(path), cacheDirectory, hash);
+    IntegralImage<A>* integral = openIntegralCache<A>(path, hash, pgm->iMax, pgm->jMax, 2);
+    *cached = integral != NULL;
+    if(integral) return integral;
+
+    SourceImage* source = readImage(filename);
+    withSourceImage(source, [&](auto* image){
+        integral = generateMomentsIntegralImageAs<A>(image, 2);
+    });
+    freeSourceImage(source);
+    writeIntegralCache(path, integral, hash, pgm->maxGray);
+    return integral;
+}
 
+// ------------------------------------------ BATCH UTILS ------------------------------------------
 /*
- * Como primeira abordagem, utilizou-se a fórmula (2) da variância no enunciado, 
- * implementado pela função a seguir deste programa. Isto pois, segundo
- * a fórmula, precisamos primeiro calcular a média da janela para finalmente calcularmos a
- * variância, necessitando percorrer duas vezes o mesmo conjunto de elementos dentro da 
- * janela.
+ * Modo --batch: muitas imagens em um único processo, então o conjunto de threads, as
+ * tabelas de despacho e os caches são aquecidos uma vez por lote e não por arquivo.
+ * Uma thread de leitura decodifica as próximas imagens e as coloca em uma fila
+ * limitada a BATCH_QUEUE_CAPACITY imagens, enquanto a thread principal (com o
+ * conjunto de threads) gera as imagens integrais e varre a imagem atual. A memória
+ * fica limitada a BATCH_QUEUE_CAPACITY + 2 imagens decodificadas.
+ *
+ * A leitura ASCII também usa runInParallel; enquanto o conjunto estiver ocupado com
+ * a varredura ela roda na própria thread de leitura (veja runInParallel).
+ *
+ * Um arquivo que não pode ser lido (ou cujas janelas não cabem em nenhum acumulador)
+ * não interrompe o lote: a thread de leitura liga recoverReadErrors e o arquivo sai
+ * no relatório com a mensagem de erro no lugar do resultado.
  */
+#define BATCH_QUEUE_CAPACITY 2
 
-VarianceResult* getVarianceAccessingTwice(Image *source, long tSize){
-    double lowestVariance = 9999999999999; // um valor bem grande
-    int iLowestVariance, jLowestVariance = -1;
-    double windowSize = tSize*tSize;
-    double windowSum, windowAvg, sumToVar, variance, windowAverage;
+typedef struct {
+    char* filename;
+    SourceImage* source; // NULL quando a leitura falhou
+    char* error;         // a mensagem da falha, ou NULL
+}BatchItem;
 
-    for(int i = 0; i < source->iMax - (tSize -1); i++){
-        for(int j = 0; j < source->jMax - (tSize -1); j++){
-            // Calculate Average
-            windowSum = 0;
-            for(int iWindow = i; iWindow < i + tSize; iWindow++){
-                for(int jWindow = j; jWindow < j + tSize; jWindow++){
-                    windowSum += source->matrix[iWindow][jWindow];
-                    checkOverflow(windowSum, 0); 
+typedef struct {
+    char** filenames;
+    int fileCount;
+    BatchItem items[BATCH_QUEUE_CAPACITY]; // fila circular
+    int begin;
+    int count;
+    long maxTSize;
+    bool finished; // a thread de leitura já colocou todos os arquivos
+    std::mutex mutex;
+    std::condition_variable changed;
+} BatchQueue;
 
-                }
-            }
-            windowAvg = windowSum / windowSize;
-            // Calculate Variance
-            sumToVar = 0;
-            for(int iWindow = i; iWindow < i + tSize; iWindow++){
-                for(int jWindow = j; jWindow < j + tSize; jWindow++){
-                    sumToVar += pow(source->matrix[iWindow][jWindow] - windowAvg, 2);
-                    checkOverflow(sumToVar, 0); 
-                }
-            }
-            variance = sumToVar / windowSize;
-            
-            if(variance < lowestVariance){
-                lowestVariance = variance;
-                windowAverage = windowAvg;
-                iLowestVariance = i;
-                jLowestVariance = j;
-            }
+int compareFilenames(const void* a, const void* b){
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+/*
+ * Os arquivos ".pgm" de um diretório, em ordem alfabética, ou as linhas não vazias de
+ * um arquivo de lista. Os nomes (e o vetor) devem ser liberados com freeBatchFiles.
+ */
+char** listBatchFiles(char* path, int* fileCount){
+    int capacity = 64;
+    char** filenames = (char**) mallocLogging(sizeof(char*) * capacity);
+    *fileCount = 0;
+    struct stat info;
+    if(stat(path, &info) != 0){
+        printf("Error: Could not open %s.\n", path);
+        exit(1);
+    }
+    DIR* directory = S_ISDIR(info.st_mode) ? opendir(path) : NULL;
+    FILE* list = directory ? NULL : fopen(path, "r");
+    if(!directory && !list){
+        printf("Error: Could not open %s.\n", path);
+        exit(1);
+    }
+    char line[4096];
+    while(true){
+        char* name;
+        size_t length;
+        if(directory){
+            struct dirent* entry = readdir(directory);
+            if(!entry) break;
+            length = strlen(entry->d_name);
+            if(length < 4 || strcmp(entry->d_name + length - 4, ".pgm") != 0) continue;
+            name = (char*) mallocLogging(strlen(path) + length + 2);
+            sprintf(name, "%s/%s", path, entry->d_name);
+        } else {
+            if(!fgets(line, sizeof(line), list)) break;
+            length = strcspn(line, "\r\n");
+            line[length] = '\0';
+            if(length == 0) continue;
+            name = (char*) mallocLogging(length + 1);
+            memcpy(name, line, length + 1);
         }
+        if(*fileCount == capacity){
+            char** larger = (char**) mallocLogging(sizeof(char*) * capacity * 2);
+            memcpy(larger, filenames, sizeof(char*) * capacity);
+            freeLogging(filenames);
+            filenames = larger;
+            capacity *= 2;
+        }
+        filenames[(*fileCount)++] = name;
+    }
+    if(directory){
+        closedir(directory);
+        qsort(filenames, *fileCount, sizeof(char*), compareFilenames);
+    } else {
+        fclose(list);
     }
+    return filenames;
+}
 
-    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
-    
-    varianceResult->windowAverage = windowAverage;
-    varianceResult->iLowestVar = iLowestVariance;
-    varianceResult->jLowestVar = jLowestVariance;
-    varianceResult->lowestVariance = lowestVariance; 
-    varianceResult->tSize = tSize;
-    
-    return varianceResult;
+void freeBatchFiles(char** filenames, int fileCount){
+    for(int f = 0; f < fileCount; f++){
+        freeLogging(filenames[f]);
+    }
+    freeLogging(filenames);
 }
 
-/* 
- * Já na segunda abordagem, utilizando a fórmula (4) do enunciado, conseguimos em uma única 
- * visita à todos os itens da janela calcular a variância.
+/*
+ * Estágio de leitura: decodifica os arquivos em ordem e espera sempre que a fila
+ * estiver cheia. As falhas entram na fila com a sua mensagem.
  */
-VarianceResult* getVarianceAccessingOnce(Image *source, long tSize){
-    double lowestVariance = 9999999999999; //long long highest value
-    int iLowestVariance, jLowestVariance = -1;
-    double windowSize = tSize*tSize;
-
-    double windowSum, sumToVar, windowAvg, variance, windowAverage; 
-    for(int i = 0; i < source->iMax - (tSize -1); i++){
-        for(int j = 0; j < source->jMax - (tSize -1); j++){
-            // Accumulate  
-            windowSum = 0;
-            sumToVar = 0;
-            for(int iWindow = i; iWindow < i + tSize; iWindow++){
-                for(int jWindow = j; jWindow < j + tSize; jWindow++){
-                    sumToVar += pow(source->matrix[iWindow][jWindow], 2);
-                    windowSum += source->matrix[iWindow][jWindow];
+void readBatchImages(BatchQueue* queue){
+    recoverReadErrors = true;
+    for(int f = 0; f < queue->fileCount; f++){
+        SourceImage* source = readImage(queue->filenames[f]);
+        if(source){
+            withSourceImage(source, [&](auto* image){
+                if(!fitsIntegralImages(image->iMax, image->jMax, source->maxGray, 2, queue->maxTSize)){
+                    failRead("Image %d x %d with max gray %lld overflows the integral images.", image->iMax, image->jMax, source->maxGray);
+                    freeSourceImage(source);
+                    source = NULL;
                 }
-            }
-            // Calculate Average
-            windowAvg = windowSum / windowSize;
-            // Calculate Variance
-            variance = (sumToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
-            
-            if(variance < lowestVariance){
-                lowestVariance = variance;
-                windowAverage = windowAvg;
-                iLowestVariance = i;
-                jLowestVariance = j;
-            }
+            });
         }
+        char* error = NULL;
+        if(!source){
+            error = (char*) mallocLogging(strlen(readErrorMessage) + 1);
+            strcpy(error, readErrorMessage);
+        }
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->changed.wait(lock, [&]{ return queue->count < BATCH_QUEUE_CAPACITY; });
+        BatchItem* item = &queue->items[(queue->begin + queue->count) % BATCH_QUEUE_CAPACITY];
+        item->filename = queue->filenames[f];
+        item->source = source;
+        item->error = error;
+        queue->count++;
+        queue->changed.notify_all();
     }
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->finished = true;
+    queue->changed.notify_all();
+}
 
-    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
-    
-    varianceResult->windowAverage = windowAverage;
-    varianceResult->iLowestVar = iLowestVariance;
-    varianceResult->jLowestVar = jLowestVariance;
-    varianceResult->lowestVariance = lowestVariance; 
-    varianceResult->tSize = tSize;
-    
-    return varianceResult;
+/*
+ * Próxima imagem lida, na ordem dos arquivos. Retorna false quando o lote acabou.
+ */
+bool takeBatchItem(BatchQueue* queue, BatchItem* item){
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    queue->changed.wait(lock, [&]{ return queue->count > 0 || queue->finished; });
+    if(queue->count == 0) return false;
+    *item = queue->items[queue->begin];
+    queue->begin = (queue->begin + 1) % BATCH_QUEUE_CAPACITY;
+    queue->count--;
+    queue->changed.notify_all();
+    return true;
 }
 
-/* 
- * E finalmente, como terceira abordagem utilizamos Imagens Integrais. Note que para que
- * o cálculo da variância ser possível foi necessário gerar duas imagens integrais: 
- * (1) sumIntegralImage que dado um ponto, continha a soma de todos os pixels à esquerda 
- * e acima dele e (2) pow2IntegralImage que contém lógica similar, porém calculando o 
- * valor da imagem original ao quadrado. Assim, foi possível com somente 8 acessos (4 em 
- * cada imagem integral) calcular a variância da janela na imagem original.
+/*
+ * Escreve "text" como um campo CSV (entre aspas quando precisa) ou como uma string
+ * JSON.
  */
-VarianceResult* getVarianceUsingIntegralImage(Image *source, long tSize){
-    Image* sumIntegralImage = generateIntegralImage(source, 1);
-    if(debugVerbose) printImage(sumIntegralImage);
+void printBatchString(char* text, bool json){
+    bool quoted = json || strpbrk(text, ",\"\n") != NULL;
+    if(quoted) putchar('"');
+    for(char* c = text; *c; c++){
+        if(*c == '"') printf(json ? "\\\"" : "\"\"");
+        else if(json && *c == '\\') printf("\\\\");
+        else if(json && (unsigned char) *c < 0x20) printf("\\u%04x", *c);
+        else putchar(*c);
+    }
+    if(quoted) putchar('"');
+}
 
-    Image* pow2IntegralImage = generateIntegralImage(source, 2);
-    if(debugVerbose) printImage(pow2IntegralImage);
+void printBatchResult(char* filename, VarianceResult* result, bool json, bool first){
+    long width = getWindowWidth(result->tSize);
+    if(json){
+        printf(first ? "  {\"file\": " : ",\n  {\"file\": ");
+        printBatchString(filename, true);
+        printf(", \"t\": %ld, \"width\": %ld, \"variance\": %.17g, \"i\": %d, \"j\": %d, \"average\": %.17g}",
+            result->tSize, width, result->lowestVariance, result->iLowestVar, result->jLowestVar, result->windowAverage);
+    } else {
+        printBatchString(filename, false);
+        printf(",%ld,%ld,%.17g,%d,%d,%.17g,\n",
+            result->tSize, width, result->lowestVariance, result->iLowestVar, result->jLowestVar, result->windowAverage);
+    }
+}
 
-    double lowestVariance = 9999999999999; //long long highest value
-    int iLowestVariance, jLowestVariance = -1;
-    double windowSize = tSize*tSize;
-
-    double pow2ToVarA, pow2ToVarB, pow2ToVarC, pow2ToVarD, 
-        pow2ToVar, sumToAvgA, sumToAvgB, sumToAvgC, sumToAvgD, 
-        windowSum, windowAvg, variance, windowAverage;
-    for(int i = 0; i < source->iMax - (tSize -1); i++){
-        for(int j = 0; j < source->jMax - (tSize -1); j++){
-            pow2ToVarA = (i == 0 || j == 0 ? 0 : pow2IntegralImage->matrix[i-1][j-1] );
-            pow2ToVarB = (i == 0 ? 0 : pow2IntegralImage->matrix[i-1][(j-1 + tSize)] );
-            pow2ToVarC = pow2IntegralImage->matrix[(i-1 + tSize)][(j-1 + tSize)];
-            pow2ToVarD = (j == 0 ? 0 : pow2IntegralImage->matrix[(i-1 + tSize)][j-1] );
-            pow2ToVar = pow2ToVarC - pow2ToVarB - pow2ToVarD + pow2ToVarA; 
-
-            sumToAvgA = (i == 0 || j == 0 ? 0 : sumIntegralImage->matrix[i-1][j-1] );
-            sumToAvgB = (i == 0 ? 0 : sumIntegralImage->matrix[i-1][(j-1 + tSize)] );
-            sumToAvgC = sumIntegralImage->matrix[(i-1 + tSize)][(j-1 + tSize)];
-            sumToAvgD = (j == 0 ? 0 : sumIntegralImage->matrix[(i-1 + tSize)][j-1] );
-            windowSum = sumToAvgC - sumToAvgB - sumToAvgD + sumToAvgA;
-            windowAvg = windowSum / windowSize;
-                
-            variance = (pow2ToVar - windowSize * pow(windowAvg, 2)) / windowSize ;
+/*
+ * Linha (ou objeto JSON) de um arquivo que não pôde ser lido: só o nome e o erro.
+ */
+void printBatchFailure(char* filename, char* error, bool json, bool first){
+    if(json){
+        printf(first ? "  {\"file\": " : ",\n  {\"file\": ");
+        printBatchString(filename, true);
+        printf(", \"error\": ");
+        printBatchString(error, true);
+        printf("}");
+    } else {
+        printBatchString(filename, false);
+        printf(",,,,,,,");
+        printBatchString(error, false);
+        printf("\n");
+    }
+}
 
-            if(variance < lowestVariance){
-                lowestVariance = variance;
-                windowAverage = windowAvg;
-                iLowestVariance = i;
-                jLowestVariance = j;
-            }
+/*
+ * Variância mínima de todos os tamanhos para cada arquivo de "path" (diretório ou
+ * lista), em CSV ou em um vetor JSON na saída padrão. Janelas que não cabem na imagem
+ * saem com i = j = -1, como nos demais modos, e os arquivos que não puderam ser lidos
+ * saem com a coluna (ou o campo) "error". Retorna o número de arquivos com erro.
+ */
+int runBatch(char* path, long* tSizes, int tSizeCount, bool json){
+    BatchQueue* queue = new BatchQueue();
+    queue->filenames = listBatchFiles(path, &queue->fileCount);
+    queue->begin = 0;
+    queue->count = 0;
+    queue->finished = false;
+    long maxTSize = 1;
+    for(int k = 0; k < tSizeCount; k++){
+        if(tSizes[k] > maxTSize) maxTSize = tSizes[k];
+    }
+    queue->maxTSize = maxTSize;
+
+    // O conjunto é criado antes da thread de leitura, que também pode usá-lo
+    if(getThreadCount() > 1) getThreadPool();
+    std::thread reader(readBatchImages, queue);
+
+    printf(json ? "[\n" : "file,t,width,variance,i,j,average,error\n");
+    bool first = true;
+    int failures = 0;
+    BatchItem item;
+    while(takeBatchItem(queue, &item)){
+        SourceImage* source = item.source;
+        if(!source){
+            printBatchFailure(item.filename, item.error, json, first);
+            first = false;
+            failures++;
+            freeLogging(item.error);
+            fflush(stdout);
+            continue;
         }
+        withSourceImage(source, [&](auto* image){
+            withIntegralType(image, source->maxGray, 2, maxTSize, [&](auto* accumulator){
+                auto* workspace = createVarianceWorkspace(image, accumulator, tSizes, tSizeCount);
+                getVarianceForAllSizes(workspace);
+                for(int k = 0; k < tSizeCount; k++){
+                    printBatchResult(item.filename, &workspace->results[k], json, first);
+                    first = false;
+                }
+                freeVarianceWorkspace(workspace);
+            });
+        });
+        freeSourceImage(source);
+        fflush(stdout);
     }
-    
-    freeImage(sumIntegralImage);
-    freeImage(pow2IntegralImage);
+    if(json) printf(first ? "]\n" : "\n]\n");
 
-    VarianceResult *varianceResult = (VarianceResult*) mallocLogging(sizeof(VarianceResult));
-    
-    varianceResult->windowAverage = windowAverage;
-    varianceResult->iLowestVar = iLowestVariance;
-    varianceResult->jLowestVar = jLowestVariance;
-    varianceResult->lowestVariance = lowestVariance; 
-    varianceResult->tSize = tSize;
-    
-    return varianceResult;
+    reader.join();
+    if(failures > 0) fprintf(stderr, "Error: %d of %d files could not be read.\n", failures, queue->fileCount);
+    freeBatchFiles(queue->filenames, queue->fileCount);
+    delete queue;
+    return failures;
 }
 
 // ------------------------------------------ MAIN UTILS ------------------------------------------
 void printEnd(){
     if(debugSimple){
         printf("\n------------------------------------------\n");
-        printf("Finished program. Pending pointers: %d \n", pendingAdressesCount);
+        printf("Finished program. Pending pointers: %d \n", arena.pendingCount);
+        printArenaStats();
         printf("------------------------------------------\n");
     }
 }
 
-void printStart(char * argv[]){
+void printStart(char * arguments[]){
     if(debugSimple){
         printf("\n------------------------------------------\n");
         printf("Starting program.\n");
-        printf("The argument supplied is %s, %s\n", argv[1], argv[2]);
+        printf("The argument supplied is %s, %s\n", arguments[0], arguments[1]);
         printf("------------------------------------------\n");
     }
 }
 
+int readThreadCount(char *arg){
+    long count = arg ? strtol(arg, NULL, 10) : 0;
+    if(count < 1){
+        printf("Error: Invalid --threads. It should be a positive number\n");
+        exit(1);
+    }
+    return count;
+}
+
 long readTSize(char *arg){
     long tSize = strtol(arg, NULL, 10);
     if(tSize == 0 || tSize < -1){
@@ -354,38 +3396,59 @@ long readTSize(char *arg){
     return tSize;
 }
 
+/*
+ * Lê "--stride S" (o mesmo passo nas duas direções) ou "--stride SIxSJ".
+ */
+void readStride(char *arg){
+    char* end = arg;
+    long strideI = arg ? strtol(arg, &end, 10) : 0;
+    long strideJ = strideI;
+    if(end != arg && *end == 'x') strideJ = strtol(end + 1, &end, 10);
+    if(strideI < 1 || strideJ < 1 || strideI > INT_MAX || strideJ > INT_MAX || (end && *end != '\0')){
+        printf("Error: Invalid --stride. It should be S or SIxSJ with positive numbers\n");
+        exit(1);
+    }
+    iStride = strideI;
+    jStride = strideJ;
+}
+
+void printWindowSize(long tSize){
+    if(windowWidth > 0) printf("T = %ld x %ld\n", tSize, windowWidth);
+    else printf("T = %ld\n", tSize);
+}
+
 typedef struct {
     VarianceResult* varianceResult;
-    double cpuTimeUsed;
+    double timeUsed; // tempo de parede, em segundos
+    bool ownsVarianceResult; // falso quando o resultado vem de uma área de trabalho
 } ClockedVarianceResult;
 
 void freeClockedVarianceResult(ClockedVarianceResult* result){
-    freeLogging(result->varianceResult);
+    if(result->ownsVarianceResult) freeLogging(result->varianceResult);
     freeLogging(result);
 }
 
 /* 
- * Função que gera o resultado em tempo de CPU encapsulando o resultado 
- * da variância original
+ * Função que gera o resultado em tempo de parede (getWallTime) encapsulando o
+ * resultado da variância original. "f" é chamada como f(source, tSize).
  */
-ClockedVarianceResult* runCalculatingTime(VarianceResult* (*f)(Image*, long), Image* source, long tSize ){
-    clock_t start, end;
-    double cpuTimeUsed;
-    start = clock();
+template <typename T, typename Function>
+ClockedVarianceResult* runCalculatingTime(Function f, Image<T>* source, long tSize, bool ownsResult = true){
+    double start = getWallTime();
 
-    VarianceResult *result = (*f)(source, tSize);
+    VarianceResult *result = f(source, tSize);
 
-    end = clock();
-    cpuTimeUsed = ((double) (end - start)) / CLOCKS_PER_SEC;
+    double timeUsed = getWallTime() - start;
 
     ClockedVarianceResult* clockedResult = (ClockedVarianceResult*) mallocLogging(sizeof(ClockedVarianceResult)); 
     clockedResult->varianceResult = result;
-    clockedResult->cpuTimeUsed = cpuTimeUsed;
+    clockedResult->timeUsed = timeUsed;
+    clockedResult->ownsVarianceResult = ownsResult;
     if(debugVerbose){
-        Image *target = allocateImage(tSize,tSize);
+        Image<T> *target = allocateImage<T>(tSize,getWindowWidth(tSize));
         for(int i = 0; i < tSize; i++){ 
-            for(int j = 0; j < tSize; j++){
-                target->matrix[i][j] = source->matrix[result->iLowestVar + i][result->jLowestVar + j];
+            for(int j = 0; j < getWindowWidth(tSize); j++){
+                pixelAt(target, i, j) = pixelAt(source, result->iLowestVar + i, result->jLowestVar + j);
             }   
         }
         printImage(target);
@@ -394,40 +3457,332 @@ ClockedVarianceResult* runCalculatingTime(VarianceResult* (*f)(Image*, long), Im
     return clockedResult;
 }
 
-void printResult(ClockedVarianceResult* result, char const* algorithmName){
-    printf("%s:\t %lf", algorithmName, result->cpuTimeUsed);
+/*
+ * Imprime a mediana do tempo e, com mais de uma medida, o mínimo e o desvio padrão.
+ */
+void printTimingStats(TimingStats stats){
+    printf(" %lf segundos", stats.median);
+    if(stats.count > 1){
+        printf("\t (mínimo %lf, desvio padrão %lf, %d execuções)", stats.min, stats.stddev, stats.count);
+    }
+    printf("\n");
+}
+
+void printResultStats(VarianceResult* result, TimingStats stats, char const* algorithmName){
     if(debugSimple) {
+        printf("%s:\t %lf", algorithmName, stats.median);
         printf("\t %lf \t %d \t %d \t %f\n", 
-            result->varianceResult->lowestVariance, 
-            result->varianceResult->iLowestVar, 
-            result->varianceResult->jLowestVar, 
-            result->varianceResult->windowAverage);
+            result->lowestVariance, 
+            result->iLowestVar, 
+            result->jLowestVar, 
+            result->windowAverage);
     } else {
-        printf(" segundos\n");
+        printf("%s:\t", algorithmName);
+        printTimingStats(stats);
     }
 }
 
-int runAll(Image* source, long tSize){
-    ClockedVarianceResult *resultTwice, *resultOnce, *resultIntegral; 
-    
-    resultTwice = runCalculatingTime(getVarianceAccessingTwice, source, tSize);
-    resultOnce = runCalculatingTime(getVarianceAccessingOnce, source, tSize);
-    resultIntegral = runCalculatingTime(getVarianceUsingIntegralImage, source, tSize);
-    
-    ClockedVarianceResult* result = resultTwice;
-    printResult(result, "Percorrendo duas vezes");
-    freeClockedVarianceResult(result);
+void printResult(ClockedVarianceResult* result, char const* algorithmName){
+    TimingStats stats = {result->timeUsed, result->timeUsed, 0, 1};
+    printResultStats(result->varianceResult, stats, algorithmName);
+}
+
+/*
+ * Comparação dos quatro algoritmos para todos os tamanhos. São feitas warmupCount
+ * execuções de aquecimento (caches, páginas e o conjunto de threads), que não são
+ * medidas, e depois repeatCount execuções medidas. Cada execução mede com o relógio
+ * de parede as fases da imagem integral (geração, varredura das faixas e redução) e
+ * cada algoritmo em cada tamanho. A varredura única de todos os tamanhos aparece só
+ * nas fases; o tempo das imagens integrais em cada tamanho é medido com uma
+ * varredura só daquele tamanho sobre a mesma imagem integral. O relatório traz a
+ * mediana, o mínimo e o desvio padrão de cada medida, em texto ou em JSON.
+ */
+#define COMPARISON_ENGINES 4
+#define COMPARISON_PHASES 3 // geração, varredura e redução
+
+char const* comparisonEngineNames[COMPARISON_ENGINES] = {
+    "Percorrendo duas vezes", "Percorrendo uma vez   ", "Imagens Integrais:    ", "Janela deslizante:    "
+};
+char const* comparisonEngineKeys[COMPARISON_ENGINES] = {"twice", "once", "integral", "sliding"};
+char const* comparisonPhaseNames[COMPARISON_PHASES] = {
+    "Geração das imagens integrais:", "Varredura das faixas (todos os tamanhos):", "Redução entre as faixas (todos os tamanhos):"
+};
+char const* comparisonPhaseKeys[COMPARISON_PHASES] = {"build", "scan", "reduce"};
+
+void printJsonStatsFields(TimingStats stats){
+    printf("\"median\": %.9f, \"min\": %.9f, \"stddev\": %.9f, \"count\": %d",
+        stats.median, stats.min, stats.stddev, stats.count);
+}
+
+void printJsonStats(char const* key, TimingStats stats){
+    printf("\"%s\": {", key);
+    printJsonStatsFields(stats);
+    printf("}");
+}
+
+template <typename T, typename A>
+void runComparison(VarianceWorkspace<T, A>* workspace, char* filename, double parseTime, int warmupCount, int repeatCount, bool json){
+    Image<T>* source = workspace->source;
+    int tSizeCount = workspace->tSizeCount;
+    int sampleSets = COMPARISON_PHASES + tSizeCount * COMPARISON_ENGINES;
+    // samples[set * repeatCount + run]
+    double* samples = (double*) mallocLogging(sizeof(double) * sampleSets * repeatCount);
+    VarianceResult* results = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * tSizeCount * COMPARISON_ENGINES);
+
+    for(int run = 0; run < warmupCount + repeatCount; run++){
+        double times[COMPARISON_PHASES + COMPARISON_ENGINES];
+        int measured = run - warmupCount;
+        rebuildWorkspaceIntegral(workspace);
+        getVarianceForAllSizes(workspace);
+        times[0] = workspace->buildTime;
+        times[1] = workspace->scanTime;
+        times[2] = workspace->reduceTime;
+        for(int set = 0; set < COMPARISON_PHASES && measured >= 0; set++){
+            samples[set * repeatCount + measured] = times[set];
+        }
+        for(int k = 0; k < tSizeCount; k++){
+            long tSize = workspace->tSizes[k];
+            ClockedVarianceResult* engineResults[COMPARISON_ENGINES];
+            engineResults[0] = runCalculatingTime(getVarianceAccessingTwice<T>, source, tSize);
+            engineResults[1] = runCalculatingTime(getVarianceAccessingOnce<T>, source, tSize);
+            engineResults[2] = runCalculatingTime([&](Image<T>*, long){
+                return getVarianceUsingWorkspace(workspace, k);
+            }, source, tSize, false);
+            engineResults[3] = runCalculatingTime(getVarianceUsingSlidingWindow<A, T>, source, tSize);
+            for(int e = 0; e < COMPARISON_ENGINES; e++){
+                int set = COMPARISON_PHASES + k * COMPARISON_ENGINES + e;
+                if(measured >= 0) samples[set * repeatCount + measured] = engineResults[e]->timeUsed;
+                results[k * COMPARISON_ENGINES + e] = *engineResults[e]->varianceResult;
+                freeClockedVarianceResult(engineResults[e]);
+            }
+        }
+    }
+
+    TimingStats parseStats = {parseTime, parseTime, 0, 1};
+    if(json){
+        printf("{\n  \"file\": ");
+        printBatchString(filename, true);
+        printf(",\n  \"threads\": %d,\n  \"simd\": %s,\n  \"exact\": %s,\n  \"warmup\": %d,\n  \"repeats\": %d,\n",
+            getThreadCount(), simdEnabled && hasAvx2() ? "true" : "false", exactVariance ? "true" : "false", warmupCount, repeatCount);
+        printf("  \"phases\": {");
+        printJsonStats("parse", parseStats);
+        for(int set = 0; set < COMPARISON_PHASES; set++){
+            printf(", ");
+            printJsonStats(comparisonPhaseKeys[set], getTimingStats(&samples[set * repeatCount], repeatCount));
+        }
+        printf("},\n  \"sizes\": [\n");
+        for(int k = 0; k < tSizeCount; k++){
+            long tSize = workspace->tSizes[k];
+            printf("    {\"t\": %ld, \"width\": %ld, \"engines\": {\n", tSize, getWindowWidth(tSize));
+            for(int e = 0; e < COMPARISON_ENGINES; e++){
+                int set = COMPARISON_PHASES + k * COMPARISON_ENGINES + e;
+                VarianceResult* result = &results[k * COMPARISON_ENGINES + e];
+                printf("      \"%s\": {", comparisonEngineKeys[e]);
+                printJsonStatsFields(getTimingStats(&samples[set * repeatCount], repeatCount));
+                printf(", \"variance\": %.17g, \"i\": %d, \"j\": %d, \"average\": %.17g}%s\n",
+                    result->lowestVariance, result->iLowestVar, result->jLowestVar, result->windowAverage,
+                    e + 1 < COMPARISON_ENGINES ? "," : "");
+            }
+            printf("    }}%s\n", k + 1 < tSizeCount ? "," : "");
+        }
+        printf("  ]\n}\n");
+    } else {
+        printf("Leitura da imagem:\t");
+        printTimingStats(parseStats);
+        for(int set = 0; set < COMPARISON_PHASES; set++){
+            printf("%s\t", comparisonPhaseNames[set]);
+            printTimingStats(getTimingStats(&samples[set * repeatCount], repeatCount));
+        }
+        for(int k = 0; k < tSizeCount; k++){
+            printWindowSize(workspace->tSizes[k]);
+            for(int e = 0; e < COMPARISON_ENGINES; e++){
+                int set = COMPARISON_PHASES + k * COMPARISON_ENGINES + e;
+                printResultStats(&results[k * COMPARISON_ENGINES + e], getTimingStats(&samples[set * repeatCount], repeatCount), comparisonEngineNames[e]);
+            }
+        }
+    }
+    freeLogging(results);
+    freeLogging(samples);
+}
+
+template <typename T, typename A>
+void printBuildTime(VarianceWorkspace<T, A>* workspace){
+    printf("Geração das imagens integrais:\t %lf segundos\n", workspace->buildTime);
+}
+
+int readRunCount(char const* flag, char *arg, int minimum){
+    long count = arg ? strtol(arg, NULL, 10) : -1;
+    if(count < minimum || count > INT_MAX){
+        printf("Error: Invalid %s. It should be a number not less than %d\n", flag, minimum);
+        exit(1);
+    }
+    return count;
+}
+
+/*
+ * Relatório dos modos que calculam todos os tamanhos em uma única passada (--stream e
+ * --cache). O tempo de cada fase é o da passada inteira, então aparece uma vez só, e
+ * cada tamanho mostra a janela de menor variância (variância, i, j e média), em
+ * texto ou em JSON no mesmo formato de runComparison.
+ */
+void printSinglePassReport(char* filename, TimingStats* phases, char const** phaseNames, char const** phaseKeys, int phaseCount,
+                           long* tSizes, VarianceResult* results, int tSizeCount, bool json){
+    if(json){
+        printf("{\n  \"file\": ");
+        printBatchString(filename, true);
+        printf(",\n  \"threads\": %d,\n  \"simd\": %s,\n  \"exact\": %s,\n  \"phases\": {",
+            getThreadCount(), simdEnabled && hasAvx2() ? "true" : "false", exactVariance ? "true" : "false");
+        for(int p = 0; p < phaseCount; p++){
+            if(p > 0) printf(", ");
+            printJsonStats(phaseKeys[p], phases[p]);
+        }
+        printf("},\n  \"sizes\": [\n");
+        for(int k = 0; k < tSizeCount; k++){
+            VarianceResult* result = &results[k];
+            printf("    {\"t\": %ld, \"width\": %ld, \"variance\": %.17g, \"i\": %d, \"j\": %d, \"average\": %.17g}%s\n",
+                tSizes[k], getWindowWidth(tSizes[k]), result->lowestVariance, result->iLowestVar, result->jLowestVar,
+                result->windowAverage, k + 1 < tSizeCount ? "," : "");
+        }
+        printf("  ]\n}\n");
+        return;
+    }
+    for(int p = 0; p < phaseCount; p++){
+        printf("%s\t", phaseNames[p]);
+        printTimingStats(phases[p]);
+    }
+    for(int k = 0; k < tSizeCount; k++){
+        VarianceResult* result = &results[k];
+        printWindowSize(tSizes[k]);
+        printf("Menor variância:\t %lf \t %d \t %d \t %f\n",
+            result->lowestVariance, result->iLowestVar, result->jLowestVar, result->windowAverage);
+    }
+}
+
+/*
+ * Modo --stream: a imagem nunca fica inteira na memória, então só a leitura em faixas
+ * com janelas deslizantes é executada. Cada repetição lê o arquivo de novo e mede a
+ * leitura única de todos os tamanhos.
+ */
+void runStreaming(char* filename, long* tSizes, int tSizeCount, int runCount, bool json){
+    VarianceResult* results = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * tSizeCount);
+    double* samples = (double*) mallocLogging(sizeof(double) * runCount);
+    for(int run = 0; run < runCount; run++){
+        double start = getWallTime();
+        scanPgmStreamForAllSizes(filename, tSizes, tSizeCount, results);
+        samples[run] = getWallTime() - start;
+    }
+    TimingStats stats = getTimingStats(samples, runCount);
+    char const* phaseName = "Leitura em faixas (todos os tamanhos):";
+    char const* phaseKey = "stream";
+    printSinglePassReport(filename, &stats, &phaseName, &phaseKey, 1, tSizes, results, tSizeCount, json);
+    freeLogging(samples);
+    freeLogging(results);
+}
+
+/*
+ * Modo --maps: em vez de comparar os algoritmos, grava os mapas de média e variância
+ * de cada tamanho a partir da imagem integral (da área de trabalho ou do cache).
+ */
+template <typename A>
+void runMaps(IntegralImage<A>* integral, long* tSizes, int tSizeCount, char* prefix){
+    for(int i = 0; i < tSizeCount; i++){
+        long tSize = tSizes[i];
+        printWindowSize(tSize);
+        double start = getWallTime();
+        VarianceMaps* maps = computeVarianceMaps(integral, tSize);
+        if(maps == NULL){
+            printf("Mapas:\t janela maior que a imagem\n");
+            continue;
+        }
+        writeVarianceMaps(maps, prefix);
+        double timeUsed = getWallTime() - start;
+        printf("Mapas:\t\t\t %lf segundos\t %s-{mean,variance}-%ld.{pfm,pgm}\n", timeUsed, prefix, tSize);
+        freeVarianceMaps(maps);
+    }
+}
+
+/*
+ * Modo --top K: as K janelas de menor variância de cada tamanho, separadas por
+ * "spacing" nas duas direções (t linhas e w colunas quando não informado, ou seja,
+ * sem sobreposição), e a mediana das variâncias como estimativa do ruído.
+ */
+template <typename A>
+void runTop(IntegralImage<A>* integral, long* tSizes, int tSizeCount, int k, long spacing){
+    for(int i = 0; i < tSizeCount; i++){
+        long tSize = tSizes[i];
+        long iSpacing = spacing > 0 ? spacing : tSize;
+        long jSpacing = spacing > 0 ? spacing : getWindowWidth(tSize);
+        printWindowSize(tSize);
+        double start = getWallTime();
+        TopVarianceResult* result = getTopVarianceWindows(integral, tSize, k, iSpacing, jSpacing);
+        double timeUsed = getWallTime() - start;
+        printf("Top %d (espaçamento %ld x %ld):\t %lf segundos\t %d janelas\n", k, iSpacing, jSpacing, timeUsed, result->count);
+        for(int w = 0; w < result->count; w++){
+            WindowCandidate* window = &result->windows[w];
+            printf("%d:\t %lf \t %d \t %d \t %f\n", w + 1, window->variance, window->i, window->j, window->windowAverage);
+        }
+        printf("Mediana da variância:\t %lf\t (desvio padrão do ruído: %lf)\n", result->medianVariance, sqrt(result->medianVariance > 0 ? result->medianVariance : 0));
+        freeTopVarianceResult(result);
+    }
+}
 
-    result = resultOnce;
-    printResult(result, "Percorrendo uma vez   ");
-    freeClockedVarianceResult(result);
+/*
+ * Modo --cache: a imagem integral vem do cache (ou é gerada e gravada nele) e só os
+ * algoritmos que dependem dela são executados, pois a imagem em si não é lida
+ * quando o cache existe. Sem --maps nem --top é exibida a janela de menor variância
+ * de cada tamanho, com o tempo da leitura do cache e da varredura única de todos os
+ * tamanhos (veja printSinglePassReport).
+ */
+void runCached(char* filename, char* cacheDirectory, long* tSizes, int tSizeCount, int runCount, char* mapsPrefix, int topCount, long topSpacing, bool json){
+    double start = getWallTime();
+    MappedPgm* pgm = mapPgm(filename);
+    if(pgm->maxGray == LLONG_MAX){
+        printf("Error: PGM max gray is greater than long long.\n");
+        exit(1);
+    }
+    uint64_t hash = hashFnv1a(pgm->data, pgm->size);
+    long maxTSize = 1;
+    for(int k = 0; k < tSizeCount; k++){
+        if(tSizes[k] > maxTSize) maxTSize = tSizes[k];
+    }
+    withIntegralType(pgm->iMax, pgm->jMax, pgm->maxGray, 2, maxTSize, [&](auto* accumulator){
+        typedef typename std::remove_pointer<decltype(accumulator)>::type A;
+        bool cached;
+        IntegralImage<A>* integral = loadIntegralImage<A>(filename, cacheDirectory, pgm, hash, &cached);
+        double loadTime = getWallTime() - start;
+        char const* loadName = cached ? "Imagens integrais do cache:" : "Geração das imagens integrais (gravadas no cache):";
+        char const* loadKey = cached ? "cache" : "build";
 
-    result = resultIntegral;
-    printResult(result, "Imagens Integrais:    ");
-    freeClockedVarianceResult(result);
+        if(mapsPrefix || topCount){
+            printf("%s\t %lf segundos\n", loadName, loadTime);
+            if(mapsPrefix) runMaps(integral, tSizes, tSizeCount, mapsPrefix);
+            if(topCount) runTop(integral, tSizes, tSizeCount, topCount, topSpacing);
+        } else {
+            VarianceResult* results = (VarianceResult*) mallocLogging(sizeof(VarianceResult) * tSizeCount);
+            double* samples = (double*) mallocLogging(sizeof(double) * runCount);
+            for(int run = 0; run < runCount; run++){
+                double scanStart = getWallTime();
+                scanIntegralImagesForAllSizes(integral, tSizes, tSizeCount, results);
+                samples[run] = getWallTime() - scanStart;
+            }
+            TimingStats phases[2] = {{loadTime, loadTime, 0, 1}, getTimingStats(samples, runCount)};
+            char const* phaseNames[2] = {loadName, "Varredura das imagens integrais (todos os tamanhos):"};
+            char const* phaseKeys[2] = {loadKey, "scan"};
+            printSinglePassReport(filename, phases, phaseNames, phaseKeys, 2, tSizes, results, tSizeCount, json);
+            freeLogging(samples);
+            freeLogging(results);
+        }
+        freeIntegralImage(integral);
+    });
+    unmapPgm(pgm);
 }
 
 /* *****************************************************************
+ *  Para compilar (a leitura usa threads):
+ * -----------------------------------------------------------------
+ * g++ -O2 -pthread reader.cpp
+ * -----------------------------------------------------------------
+ *
  *  É possível executar o programa usando a seguinte configuração
  * No primeiro, como foi pedido no enunciado do EP
  * -----------------------------------------------------------------
@@ -439,20 +3794,148 @@ int runAll(Image* source, long tSize){
  * -----------------------------------------------------------------
  * ./a.out images/desired.pgm -1
  * -----------------------------------------------------------------
+ *
+ * Os tempos são de parede e cada comparação faz uma execução de
+ * aquecimento antes das medidas; --repeat e --warmup mudam o número
+ * de execuções medidas e de aquecimento, e --format json troca o
+ * relatório (mediana, mínimo e desvio padrão de cada fase e de cada
+ * algoritmo) por um JSON
+ * -----------------------------------------------------------------
+ * ./a.out --repeat 10 --warmup 2 --format json images/desired.pgm 25
+ * -----------------------------------------------------------------
+ *
+ * Por padrão são usadas todas as threads da máquina, o que pode ser
+ * alterado com --threads antes dos argumentos
+ * -----------------------------------------------------------------
+ * ./a.out --threads 4 images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * Com --exact as janelas das imagens integrais são comparadas pela
+ * variância exata, em inteiros (veja scanIntegralRowExact)
+ * -----------------------------------------------------------------
+ * ./a.out --exact images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * Imagens maiores que a memória podem ser lidas em faixas com --stream,
+ * guardando só as últimas t linhas (veja scanPgmStreamForAllSizes)
+ * -----------------------------------------------------------------
+ * ./a.out --stream images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * Os mapas completos de média e variância local (PFM em float e mapas
+ * de calor em P5) são gravados com --maps e um prefixo de saída
+ * -----------------------------------------------------------------
+ * ./a.out --maps saida/desired images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * As K janelas de menor variância, a pelo menos S pixels umas das
+ * outras (por padrão t, sem sobreposição), e a mediana delas
+ * -----------------------------------------------------------------
+ * ./a.out --top 10 --spacing 20 images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * Janelas retangulares t x W com --width (t continua sendo a altura)
+ * e uma busca grossa, só com os cantos múltiplos do passo, com
+ * --stride S ou --stride SIxSJ
+ * -----------------------------------------------------------------
+ * ./a.out --width 64 --stride 4 images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * Um lote de imagens (os .pgm de um diretório, ou um arquivo com um
+ * nome por linha) em um único processo, com o resultado de cada
+ * imagem e tamanho em CSV ou JSON na saída padrão. Arquivos que não
+ * podem ser lidos saem com o erro e o lote continua; nesse caso o
+ * programa termina com status 1
+ * -----------------------------------------------------------------
+ * ./a.out --batch --format json images 25
+ * -----------------------------------------------------------------
+ *
+ * As imagens integrais podem ser guardadas em um diretório de cache
+ * com --cache; nas execuções seguintes com a mesma imagem elas são
+ * mapeadas do disco, sem ler a imagem nem gerar as tabelas
+ * -----------------------------------------------------------------
+ * ./a.out --cache /tmp/cache images/desired.pgm 9
+ * -----------------------------------------------------------------
+ *
+ * A imagem pode estar tanto no formato ASCII (P2) quanto no binário
+ * (P5). O formato binário é mapeado em memória e lido bem mais rápido.
  * *****************************************************************/
+#ifndef READER_NO_MAIN
 int main(int argc, char * argv[]){
-    if( argc != 3 ) {
-        printf("Call this program using 2 arguments. Filename and T-Size. Ex: './program filename.pgm 50.\n");
+    char* arguments[2];
+    int argumentCount = 0;
+    bool streamMode = false;
+    char* mapsPrefix = NULL;
+    int topCount = 0;
+    long topSpacing = 0;
+    bool batchMode = false;
+    bool jsonFormat = false;
+    char* cacheDirectory = NULL;
+    int repeatCount = 0; // 0 = 1 execução, ou 5 com t = -1
+    int warmupCount = 1;
+    for(int a = 1; a < argc; a++){
+        if(strcmp(argv[a], "--threads") == 0){
+            threadCount = readThreadCount(a + 1 < argc ? argv[++a] : NULL);
+        } else if(strcmp(argv[a], "--exact") == 0){
+            exactVariance = true;
+        } else if(strcmp(argv[a], "--stream") == 0){
+            streamMode = true;
+        } else if(strcmp(argv[a], "--maps") == 0){
+            if(a + 1 >= argc){
+                printf("Error: --maps needs an output prefix.\n");
+                exit(1);
+            }
+            mapsPrefix = argv[++a];
+        } else if(strcmp(argv[a], "--top") == 0 || strcmp(argv[a], "--spacing") == 0){
+            long value = a + 1 < argc ? strtol(argv[a + 1], NULL, 10) : 0;
+            if(value < 1 || value > INT_MAX / TOP_CANDIDATES_PER_WINDOW){
+                printf("Error: %s needs a positive number.\n", argv[a]);
+                exit(1);
+            }
+            if(strcmp(argv[a], "--top") == 0) topCount = value;
+            else topSpacing = value;
+            a++;
+        } else if(strcmp(argv[a], "--width") == 0){
+            windowWidth = a + 1 < argc ? strtol(argv[++a], NULL, 10) : 0;
+            if(windowWidth < 1 || windowWidth > INT_MAX){
+                printf("Error: Invalid --width. It should be a positive number\n");
+                exit(1);
+            }
+        } else if(strcmp(argv[a], "--stride") == 0){
+            readStride(a + 1 < argc ? argv[++a] : NULL);
+        } else if(strcmp(argv[a], "--cache") == 0){
+            if(a + 1 >= argc){
+                printf("Error: --cache needs a directory.\n");
+                exit(1);
+            }
+            cacheDirectory = argv[++a];
+        } else if(strcmp(argv[a], "--repeat") == 0){
+            repeatCount = readRunCount("--repeat", a + 1 < argc ? argv[++a] : NULL, 1);
+        } else if(strcmp(argv[a], "--warmup") == 0){
+            warmupCount = readRunCount("--warmup", a + 1 < argc ? argv[++a] : NULL, 0);
+        } else if(strcmp(argv[a], "--batch") == 0){
+            batchMode = true;
+        } else if(strcmp(argv[a], "--format") == 0){
+            char* format = a + 1 < argc ? argv[++a] : NULL;
+            if(!format || (strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)){
+                printf("Error: --format should be csv or json.\n");
+                exit(1);
+            }
+            jsonFormat = strcmp(format, "json") == 0;
+        } else if(argumentCount < 2){
+            arguments[argumentCount++] = argv[a];
+        } else {
+            argumentCount++;
+        }
+    }
+    if( argumentCount != 2 ) {
+        printf("Call this program using 2 arguments. Filename and T-Size. Ex: './program [--threads N] [--exact] [--width W] [--stride S] [--repeat N] [--warmup W] [--format csv|json] [--cache dir] [--stream | --maps prefix | --top K [--spacing S] | --batch] filename.pgm 50.\n");
         exit(1);
     }
 
-    printStart(argv);
-    long tSize = readTSize(argv[2]);
-
-    Image* source = readImage(argv[1]);
-    if (debugVerbose) printImage(source);
+    printStart(arguments);
+    long tSize = readTSize(arguments[1]);
     
-    ClockedVarianceResult *resultTwice, *resultOnce, *resultIntegral; 
     int runCount = 1;
     long* tSizes;
     int tSizeCount;
@@ -473,21 +3956,73 @@ int main(int argc, char * argv[]){
         tSizes = (long*) mallocLogging(sizeof(long)*tSizeCount);
         tSizes[0] = tSize ;
     }
+    if(repeatCount > 0) runCount = repeatCount;
 
-    for(int run = 0; run < runCount; run++){
-        for(int i = 0; i < tSizeCount; i++){
-            printf("T = %ld\n", tSizes[i]);
-            runAll(source, tSizes[i]);
-        }
+    if(streamMode && (mapsPrefix || topCount)){
+        printf("Error: --maps and --top can't be used with --stream.\n");
+        exit(1);
+    }
+    if(batchMode && (streamMode || mapsPrefix || topCount)){
+        printf("Error: --batch can't be used with --stream, --maps or --top.\n");
+        exit(1);
     }
+    if(cacheDirectory && (streamMode || batchMode)){
+        printf("Error: --cache can't be used with --stream or --batch.\n");
+        exit(1);
+    }
+    if(cacheDirectory){
+        runCached(arguments[0], cacheDirectory, tSizes, tSizeCount, runCount, mapsPrefix, topCount, topSpacing, jsonFormat);
+        freeLogging(tSizes);
+        destroyThreadPool();
+        releaseArenaCache();
+        printEnd();
+        return 0;
+    }
+    if(batchMode){
+        int failures = runBatch(arguments[0], tSizes, tSizeCount, jsonFormat);
+        freeLogging(tSizes);
+        destroyThreadPool();
+        releaseArenaCache();
+        printEnd();
+        return failures > 0 ? 1 : 0;
+    }
+    if(streamMode){
+        runStreaming(arguments[0], tSizes, tSizeCount, runCount, jsonFormat);
+        freeLogging(tSizes);
+        destroyThreadPool();
+        releaseArenaCache();
+        printEnd();
+        return 0;
+    }
+
+    double parseStart = getWallTime();
+    SourceImage* source = readImage(arguments[0]);
+    double parseTime = getWallTime() - parseStart;
+    if (debugVerbose) withSourceImage(source, [](auto* image){ printImage(image); });
+
+    withSourceImage(source, [&](auto* image){
+        withIntegralType(image, source->maxGray, 2, tSizes[tSizeCount - 1], [&](auto* accumulator){
+            auto* workspace = createVarianceWorkspace(image, accumulator, tSizes, tSizeCount);
+            if(mapsPrefix || topCount) printBuildTime(workspace);
+            if(mapsPrefix) runMaps(workspace->integral, tSizes, tSizeCount, mapsPrefix);
+            if(topCount) runTop(workspace->integral, tSizes, tSizeCount, topCount, topSpacing);
+            if(!mapsPrefix && !topCount){
+                runComparison(workspace, arguments[0], parseTime, warmupCount, runCount, jsonFormat);
+            }
+            freeVarianceWorkspace(workspace);
+        });
+    });
 
     freeLogging(tSizes);
-    freeImage(source);
+    freeSourceImage(source);
+    destroyThreadPool();
+    releaseArenaCache();
     
     printEnd();
 
     return 0;
 }
+#endif
 
 /* ===================================================================================
  * Relatório de Resultados